@@ -689,18 +689,62 @@ void qq_set_custom_icon(PurpleConnection *gc, PurpleStoredImage *img)
 	purple_debug_info("QQ", "Change my icon to %s\n", icon_path);
 }
 
-gchar *qq_get_icon_name(gint face)
+/* stock icon files shared by all accounts, loaded when first used */
+typedef struct _qq_stock_icon {
+	gchar *name;
+	gchar *path;		/* where data was read, NULL if never tried */
+	gchar *data;		/* NULL if failed to read */
+	gsize size;
+} qq_stock_icon;
+
+static qq_stock_icon stock_icons[QQ_FACES + 1];	/* by icon, 0 is not used */
+
+static gint face_to_icon(gint face)
 {
 	gint icon;
-	gchar *icon_name;
 
 	icon = face / 3 + 1;
 	if (icon < 1 || icon > QQ_FACES) {
 		icon = 1;
 	}
+	return icon;
+}
+
+static const gchar *stock_icon_name(gint icon)
+{
+	if (stock_icons[icon].name == NULL) {
+		stock_icons[icon].name = g_strdup_printf("%s%d%s", QQ_ICON_PREFIX, icon, QQ_ICON_SUFFIX);
+	}
+	return stock_icons[icon].name;
+}
+
+/* read icon file again only if icon_dir is changed */
+static qq_stock_icon *stock_icon_load(gint icon)
+{
+	qq_stock_icon *stock = &stock_icons[icon];
+	gchar *path;
+
+	path = qq_get_icon_path((gchar *) stock_icon_name(icon));
+	if (stock->path != NULL && strcmp(stock->path, path) == 0) {
+		g_free(path);
+		return stock;
+	}
+
+	g_free(stock->path);
+	g_free(stock->data);
+	stock->path = path;
+	stock->data = NULL;
+	stock->size = 0;
+	if (!g_file_get_contents(path, &stock->data, &stock->size, NULL)) {
+		purple_debug_error("QQ", "Failed reading icon file %s\n", path);
+		stock->data = NULL;
+	}
+	return stock;
+}
 
-	icon_name = g_strdup_printf("%s%d%s", QQ_ICON_PREFIX, icon, QQ_ICON_SUFFIX);
-	return icon_name;
+gchar *qq_get_icon_name(gint face)
+{
+	return g_strdup(stock_icon_name(face_to_icon(face)));
 }
 
 /*
@@ -742,21 +786,21 @@ gchar *qq_get_icon_path(gchar *icon_name)
 	return icon_path;
 }
 
-void qq_update_buddy_icon(PurpleAccount *account, const gchar *who, gint face)
+/* return the stock icon shown for who, 0 if it could not be set */
+gint qq_update_buddy_icon(PurpleAccount *account, const gchar *who, gint face)
 {
 	PurpleBuddy *buddy;
 	const gchar *icon_name_prev = NULL;
-	gchar *icon_name;
-	gchar *icon_path;
-	gchar *icon_file_content;
-	gsize icon_file_size;
+	const gchar *icon_name;
+	qq_stock_icon *stock;
+	gint icon;
 
-	g_return_if_fail(account != NULL && who != NULL);
+	g_return_val_if_fail(account != NULL && who != NULL, 0);
 
 	/* purple_debug_info("QQ", "Update %s icon to %d\n", who, face); */
 
-	icon_name = qq_get_icon_name(face);
-	g_return_if_fail(icon_name != NULL);
+	icon = face_to_icon(face);
+	icon_name = stock_icon_name(icon);
 	/* purple_debug_info("QQ", "icon file name is %s\n", icon_name); */
 
 	if ((buddy = purple_find_buddy(account, who))) {
@@ -768,26 +812,35 @@ void qq_update_buddy_icon(PurpleAccount *account, const gchar *who, gint face)
 	}
 	if (icon_name_prev != NULL && !strcmp(icon_name, icon_name_prev)) {
 		/* purple_debug_info("QQ", "Icon is not changed\n"); */
-		g_free(icon_name);
-		return;
+		return icon;
 	}
 
-	icon_path = qq_get_icon_path(icon_name);
-	if (icon_path == NULL) {
-		g_free(icon_name);
-		return;
+	stock = stock_icon_load(icon);
+	if (stock->data == NULL) {
+		return 0;
 	}
+	purple_debug_info("QQ", "Update %s icon to %d (%s)\n",
+			who, face, stock->path);
+	/* purple takes the data, give it a copy */
+	purple_buddy_icons_set_for_user(account, who,
+			g_memdup(stock->data, stock->size), stock->size, icon_name);
+	return icon;
+}
 
-	if (!g_file_get_contents(icon_path, &icon_file_content, &icon_file_size, NULL)) {
-		purple_debug_error("QQ", "Failed reading icon file %s\n", icon_path);
-	} else {
-		purple_debug_info("QQ", "Update %s icon to %d (%s)\n",
-				who, face, icon_path);
-		purple_buddy_icons_set_for_user(account, who,
-				icon_file_content, icon_file_size, icon_name);
+/* face in IM comes with every message, only update icon if it is changed */
+void qq_update_buddy_face(PurpleAccount *account, const gchar *who, qq_buddy_data *bd, guint16 face)
+{
+	gint icon;
+
+	g_return_if_fail(bd != NULL);
+
+	bd->face = face;
+	icon = face_to_icon(face);
+	if (bd->icon == icon) {
+		return;
 	}
-	g_free(icon_name);
-	g_free(icon_path);
+	/* stays 0 if stock icon is missing, try again next time */
+	bd->icon = qq_update_buddy_icon(account, who, face);
 }
 
 /* process reply to get_info packet */
@@ -895,15 +948,15 @@ void qq_process_get_buddy_info(guint8 *data, gint data_len, guint32 action, Purp
 		bd->face = face;
 
 		if (nickname != NULL) {
-			if (bd->nickname) g_free(bd->nickname);
-			bd->nickname = g_strdup(nickname);
+			qq_str_unref(bd->nickname);
+			bd->nickname = qq_str_intern(qd->str_pool, nickname);
 		}
 		bd->last_update = time(NULL);
 
 		purple_blist_server_alias_buddy(buddy, bd->nickname);
 
 		/* convert face num from packet (0-299) to local face (1-100) */
-		qq_update_buddy_icon(gc->account, who, bd->face);
+		bd->icon = qq_update_buddy_icon(gc->account, who, bd->face);
 	}
 
 	g_free(who);
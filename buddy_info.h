@@ -87,7 +87,8 @@ void qq_request_get_level(PurpleConnection *gc, guint32 uid);
 void qq_request_get_buddies_level(PurpleConnection *gc, guint32 update_class, guint pos);
 void qq_process_get_level_reply(guint8 *buf, gint buf_len, PurpleConnection *gc);
 
-void qq_update_buddy_icon(PurpleAccount *account, const gchar *who, gint face);
+gint qq_update_buddy_icon(PurpleAccount *account, const gchar *who, gint face);
+void qq_update_buddy_face(PurpleAccount *account, const gchar *who, qq_buddy_data *bd, guint16 face);
 void request_change_info(PurpleConnection *gc, guint8 *data, guint8 *token, guint token_size);
 void qq_request_get_buddies_sign(PurpleConnection *gc, guint32 update_class, guint32 pos);
 void qq_process_get_buddies_sign(guint8 *data, gint data_len, PurpleConnection *gc);
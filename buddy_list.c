@@ -49,6 +49,18 @@ typedef struct _qq_buddy_online {
 	guint8 ending;		/* 0x00 */
 } qq_buddy_online;
 
+/* entry of get_buddies_list reply, see buddy_entry_next */
+typedef struct _qq_buddy_entry {
+	guint32 uid;
+	guint16 face;
+	guint8 age;
+	guint8 gender;
+	guint8 *nickname;	/* point into reply, not NUL terminated */
+	guint8 nickname_len;
+	guint8 ext_flag;
+	guint8 comm_flag;
+} qq_buddy_entry;
+
 /* get a list of online_buddies */
 void qq_request_get_buddies_online(PurpleConnection *gc, guint8 position, guint32 update_class)
 {
@@ -144,10 +156,13 @@ static gint get_buddy_status(qq_buddy_status *bs, guint8 *data)
 	/* 034-034: comm_flag */
 	bytes += qq_get8(&bs->comm_flag, data + bytes);
 
-	purple_debug_info("QQ", "Status: %d, uid: %u, ip: %s:%d Flag: 0x%X - 0x%X, Unknown: %d - %d - %d, Ver: %04X\n",
-			bs->status, bs->uid, inet_ntoa(bs->ip), bs->port,
-			bs->ext_flag, bs->comm_flag, 
-			bs->flag1, bs->flag2, bs->unknown, bs->version);
+	/* called once per entry of the online list, keep formatting off the fast path */
+	if (purple_debug_is_verbose()) {
+		purple_debug_info("QQ", "Status: %d, uid: %u, ip: %s:%d Flag: 0x%X - 0x%X, Unknown: %d - %d - %d, Ver: %04X\n",
+				bs->status, bs->uid, inet_ntoa(bs->ip), bs->port,
+				bs->ext_flag, bs->comm_flag,
+				bs->flag1, bs->flag2, bs->unknown, bs->version);
+	}
 
 	return bytes;
 }
@@ -181,8 +196,6 @@ guint8 qq_process_get_buddies_online(guint8 *data, gint data_len, PurpleConnecti
 					(data_len - bytes), entry_len);
 			break;
 		}
-		memset(&bs, 0 ,sizeof(bs));
-
 		/* set flag */
 		bytes_start = bytes;
 		/* based on one online buddy entry */
@@ -218,6 +231,7 @@ guint8 qq_process_get_buddies_online(guint8 *data, gint data_len, PurpleConnecti
 			bd->status = bs.status;
 			bd->comm_flag = bs.comm_flag;
 			qq_update_buddy_status(gc, bd->uid, bd->status, bd->comm_flag);
+			qd->online_changes++;
 		}
 		bd->ip.s_addr = bs.ip.s_addr;
 		bd->port = bs.port;
@@ -245,6 +259,7 @@ guint32 qq_process_get_group_list(guint8 *data, gint data_len, PurpleConnection
 	guint8 position;
 	qq_group * g;
 	GSList *l;
+	gchar *name;
 
 	g_return_val_if_fail(data != NULL && data_len != 0, -1);
 
@@ -269,7 +284,9 @@ guint32 qq_process_get_group_list(guint8 *data, gint data_len, PurpleConnection
 		g = g_new0(qq_group, 1);
 		bytes += qq_get8(&g->group_id, data+bytes);
 		bytes += 1;  /* one byte : group_id+1 */
-		bytes += qq_get_vstr(&g->group_name, NULL, sizeof(guint8), data+bytes);
+		bytes += qq_get_vstr(&name, NULL, sizeof(guint8), data+bytes);
+		g->group_name = qq_str_intern(qd->str_pool, name);
+		g_free(name);
 		purple_debug_info("QQ", "Get a Group: %s\n", g->group_name);
 		qq_group_find_or_new(g->group_name);
 		qd->group_list = g_slist_append(qd->group_list, g);
@@ -286,8 +303,10 @@ guint32 qq_process_get_group_list(guint8 *data, gint data_len, PurpleConnection
 		{
 			g = g_new0(qq_group, 1);
 			g->group_id = 0;
-			g->group_name = g_strdup_printf("QQ (%s)",
+			name = g_strdup_printf("QQ (%s)",
 				purple_account_get_username(gc->account));
+			g->group_name = qq_str_intern(qd->str_pool, name);
+			g_free(name);
 			qq_group_find_or_new(g->group_name);
 			qd->group_list = g_slist_append(qd->group_list, g);
 		}
@@ -303,17 +322,58 @@ guint32 qq_process_get_group_list(guint8 *data, gint data_len, PurpleConnection
 	return position;
 }
 
+/* parse one entry of get_buddies_list reply at *cursor,
+ * nickname is borrowed from data and is not NUL terminated
+ * return FALSE if the entry is truncated, cursor is always moved over it */
+static gboolean buddy_entry_next(qq_buddy_entry *be, guint8 *data, gint data_len, gint *cursor)
+{
+	gint bytes = *cursor;
+
+	/* 40 bytes fixed plus nickname */
+	if (data_len - bytes < 9) {
+		*cursor = data_len;
+		return FALSE;
+	}
+
+	/* 000-003: uid */
+	bytes += qq_get32(&be->uid, data + bytes);
+	/* 004-005: icon index (1-255) */
+	bytes += qq_get16(&be->face, data + bytes);
+	/* 006-006: age */
+	bytes += qq_get8(&be->age, data + bytes);
+	/* 007-007: gender */
+	bytes += qq_get8(&be->gender, data + bytes);
+	/* 008-008: nickname length, then nickname */
+	bytes += qq_get8(&be->nickname_len, data + bytes);
+	be->nickname = data + bytes;
+	bytes += be->nickname_len;
+
+	if (data_len - bytes < 32) {
+		*cursor = data_len;
+		return FALSE;
+	}
+	/* TODO: merge following as 32bit flag */
+	bytes += 2;		/* unknown */
+	bytes += qq_get8(&be->ext_flag, data + bytes);
+	bytes += qq_get8(&be->comm_flag, data + bytes);
+	bytes += 32-4;
+
+	*cursor = bytes;
+	return TRUE;
+}
+
 /* process reply for get_buddies_list */
 guint16 qq_process_get_buddies_list(guint8 *data, gint data_len, PurpleConnection *gc)
 {
 	qq_data *qd;
-	qq_buddy_data bd;
-	gint bytes_expected, count;
-	gint bytes, buddy_bytes;
-	gint nickname_len;
-	guint16 position, unknown;
+	qq_buddy_data *bd;
+	qq_buddy_entry be;
+	gchar nickname[256];
+	gint count;
+	gint bytes;
+	guint16 position;
 	PurpleBuddy *buddy;
-	gchar *who;
+	gboolean is_new;
 
 	g_return_val_if_fail(data != NULL && data_len != 0, -1);
 
@@ -331,57 +391,47 @@ guint16 qq_process_get_buddies_list(guint8 *data, gint data_len, PurpleConnectio
 	count = 0;
 	while (bytes < data_len-5) /* end with 04 4D XX XX XX */
 	{
-		memset(&bd, 0, sizeof(bd));
-		/* set flag */
-		buddy_bytes = bytes;
-		/* 000-003: uid */
-		bytes += qq_get32(&bd.uid, data + bytes);
-		/* 004-005: icon index (1-255) */
-		bytes += qq_get16(&bd.face, data + bytes);
-		/* 006-006: age */
-		bytes += qq_get8(&bd.age, data + bytes);
-		/* 007-007: gender */
-		bytes += qq_get8(&bd.gender, data + bytes);
-
-		bytes += nickname_len = qq_get_vstr(&bd.nickname, NULL, sizeof(guint8), data+bytes);
-
-		qq_filter_str(bd.nickname);
-
-		/* TODO: merge following as 32bit flag */
-		bytes += qq_get16(&unknown, data + bytes);
-		bytes += qq_get8(&bd.ext_flag, data + bytes);
-		bytes += qq_get8(&bd.comm_flag, data + bytes);
-
-		bytes += 32-4;
-		bytes_expected = 40 + nickname_len;
-
-		if (bd.uid == 0 || (bytes - buddy_bytes) != bytes_expected) {
-			purple_debug_info("QQ",
-					"Buddy entry, expect %d bytes, read %d bytes\n",
-					bytes_expected, bytes - buddy_bytes);
-			g_free(bd.nickname);
+		if ( !buddy_entry_next(&be, data, data_len, &bytes) ) {
+			purple_debug_error("QQ", "Buddy entry is truncated\n");
+			break;
+		}
+		if (be.uid == 0) {
 			continue;
-		} else {
-			count++;
 		}
+		count++;
 
-#if 1
-		purple_debug_info("QQ", "buddy [%d]: ext_flag=0x%02x, comm_flag=0x%02x, nick=%s\n",
-				bd.uid, bd.ext_flag, bd.comm_flag, bd.nickname);
-#endif
+		if (purple_debug_is_verbose()) {
+			purple_debug_info("QQ", "buddy [%u]: ext_flag=0x%02x, comm_flag=0x%02x, nick=%.*s\n",
+					be.uid, be.ext_flag, be.comm_flag, be.nickname_len, be.nickname);
+		}
 
-		buddy = qq_buddy_find_or_new(gc, bd.uid, 0xFF);
-		if (buddy == NULL || purple_buddy_get_protocol_data(buddy) == NULL) {
-			g_free(bd.nickname);
+		buddy = qq_buddy_find_or_new(gc, be.uid, 0xFF);
+		bd = (buddy == NULL) ? NULL : (qq_buddy_data *)purple_buddy_get_protocol_data(buddy);
+		if (bd == NULL) {
 			continue;
 		}
-		who = purple_buddy_get_name(buddy);
-		serv_got_alias(gc, who, bd.nickname);
+		is_new = (bd->last_update == 0);
 
-		bd.last_update = time(NULL);
-		qq_update_buddy_status(gc, bd.uid, bd.status, bd.comm_flag);
+		bd->face = be.face;
+		bd->age = be.age;
+		bd->gender = be.gender;
+		bd->ext_flag = be.ext_flag;
+		bd->last_update = time(NULL);
+
+		/* filter in a stack copy, only allocate when nickname is changed */
+		memcpy(nickname, be.nickname, be.nickname_len);
+		nickname[be.nickname_len] = '\0';
+		qq_filter_str(nickname);
+		if (bd->nickname == NULL || strcmp(bd->nickname, nickname) != 0) {
+			qq_str_unref(bd->nickname);
+			bd->nickname = qq_str_intern(qd->str_pool, nickname);
+			serv_got_alias(gc, purple_buddy_get_name(buddy), bd->nickname);
+		}
 
-		g_memmove(purple_buddy_get_protocol_data(buddy), &bd, sizeof(qq_buddy_data));
+		if (is_new || bd->comm_flag != be.comm_flag) {
+			bd->comm_flag = be.comm_flag;
+			qq_update_buddy_status(gc, bd->uid, bd->status, bd->comm_flag);
+		}
 	}
 
 	if(bytes > data_len) {
@@ -658,3 +708,15 @@ void qq_buddy_data_free_all(PurpleConnection *gc)
 	}
 }
 
+void qq_group_list_free_all(PurpleConnection *gc)
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+	qq_group *g;
+
+	while (qd->group_list != NULL) {
+		g = (qq_group *) qd->group_list->data;
+		qd->group_list = g_slist_remove(qd->group_list, g);
+		qq_str_unref(g->group_name);
+		g_free(g);
+	}
+}
@@ -113,7 +113,7 @@ void qq_buddy_data_free(qq_buddy_data *bd)
 {
 	g_return_if_fail(bd != NULL);
 
-	if (bd->nickname) g_free(bd->nickname);
+	qq_str_unref(bd->nickname);
 	g_free(bd);
 }
 
@@ -31,17 +31,136 @@
 
 #define QQ_NULL_MSG           "(NULL)"	/* return this if conversion fails */
 
-/* convert a string from from_charset to to_charset, using g_convert */
+/* converters kept open between calls, conversions run in the main loop only */
+#define QQ_CONV_CACHE_MAX		8
+
+typedef struct _qq_conv_slot {
+	gchar *to_charset;
+	gchar *from_charset;
+	GIConv cd;
+} qq_conv_slot;
+
+static qq_conv_slot conv_cache[QQ_CONV_CACHE_MAX];
+static gint conv_cache_count = 0;
+static gint conv_cache_next = 0;	/* slot to be reused when cache is full */
+
+void qq_conv_cache_free(void)
+{
+	gint i;
+
+	for (i = 0; i < conv_cache_count; i++) {
+		g_iconv_close(conv_cache[i].cd);
+		g_free(conv_cache[i].to_charset);
+		g_free(conv_cache[i].from_charset);
+	}
+	conv_cache_count = 0;
+	conv_cache_next = 0;
+}
+
+/* return a converter in initial state, or (GIConv) -1 if not supported */
+static GIConv conv_get(const gchar *to_charset, const gchar *from_charset)
+{
+	qq_conv_slot *slot;
+	GIConv cd;
+	gint i;
+
+	for (i = 0; i < conv_cache_count; i++) {
+		slot = &conv_cache[i];
+		if (strcmp(slot->to_charset, to_charset) == 0
+				&& strcmp(slot->from_charset, from_charset) == 0) {
+			/* drop any shift state left by last failed conversion */
+			g_iconv(slot->cd, NULL, NULL, NULL, NULL);
+			return slot->cd;
+		}
+	}
+
+	cd = g_iconv_open(to_charset, from_charset);
+	if (cd == (GIConv) -1) {
+		return cd;
+	}
+
+	if (conv_cache_count < QQ_CONV_CACHE_MAX) {
+		slot = &conv_cache[conv_cache_count++];
+	} else {
+		slot = &conv_cache[conv_cache_next];
+		conv_cache_next = (conv_cache_next + 1) % QQ_CONV_CACHE_MAX;
+		g_iconv_close(slot->cd);
+		g_free(slot->to_charset);
+		g_free(slot->from_charset);
+	}
+	slot->to_charset = g_strdup(to_charset);
+	slot->from_charset = g_strdup(from_charset);
+	slot->cd = cd;
+	return cd;
+}
+
+/* all charsets used by QQ keep ASCII bytes as they are */
+static gboolean charset_keeps_ascii(const gchar *charset)
+{
+	return g_ascii_strcasecmp(charset, UTF8) == 0
+		|| g_ascii_strcasecmp(charset, QQ_CHARSET_ZH_CN) == 0
+		|| g_ascii_strcasecmp(charset, QQ_CHARSET_ENG) == 0;
+}
+
+/* check a machine word a time, most nicknames and messages end here */
+static gboolean str_is_ascii(const gchar *str, gsize len)
+{
+	const guint8 *p = (const guint8 *) str;
+	guint64 word;
+
+	while (len >= sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		if (word & G_GUINT64_CONSTANT(0x8080808080808080)) {
+			return FALSE;
+		}
+		p += sizeof(word);
+		len -= sizeof(word);
+	}
+	while (len > 0) {
+		if (*p & 0x80) {
+			return FALSE;
+		}
+		p++;
+		len--;
+	}
+	return TRUE;
+}
+
+/* convert a string from from_charset to to_charset, using cached iconv */
 /* Warning: do not return NULL */
 static gchar *do_convert(const gchar *str, gssize len, gsize *out_len, const gchar *to_charset, const gchar *from_charset)
 {
 	GError *error = NULL;
+	GIConv cd;
 	gchar *ret;
 	gsize byte_read, byte_write;
 
 	g_return_val_if_fail(str != NULL && to_charset != NULL && from_charset != NULL, g_strdup(QQ_NULL_MSG));
 
-	ret = g_convert(str, len, to_charset, from_charset, &byte_read, &byte_write, &error);
+	if (len < 0) {
+		len = strlen(str);
+	}
+
+	if (str_is_ascii(str, len)
+			&& charset_keeps_ascii(to_charset) && charset_keeps_ascii(from_charset)) {
+		ret = g_malloc(len + 1);
+		memcpy(ret, str, len);
+		ret[len] = '\0';
+		if (out_len)
+			*out_len = len;
+		return ret;
+	}
+
+	cd = conv_get(to_charset, from_charset);
+	if (cd == (GIConv) -1) {
+		purple_debug_error("QQ_CONVERT", "Not support conversion from %s to %s\n",
+				from_charset, to_charset);
+		if (out_len)
+			*out_len = strlen(QQ_NULL_MSG);
+		return g_strdup(QQ_NULL_MSG);
+	}
+
+	ret = g_convert_with_iconv(str, len, cd, &byte_read, &byte_write, &error);
 
 	if (error == NULL) {
 		if (out_len)
@@ -51,12 +170,84 @@ static gchar *do_convert(const gchar *str, gssize len, gsize *out_len, const gch
 
 	/* convert error */
 	purple_debug_error("QQ_CONVERT", "%s\n", error->message);
-	qq_show_packet("Dump failed text", (guint8 *) str, (len == -1) ? strlen(str) : len);
+	qq_show_packet("Dump failed text", (guint8 *) str, len);
 
 	g_error_free(error);
+	if (out_len)
+		*out_len = strlen(QQ_NULL_MSG);
 	return g_strdup(QQ_NULL_MSG);
 }
 
+/* room for converted slice, no charset turns a byte into more than 4 bytes */
+static gsize batch_slice_room(gsize len)
+{
+	return MAX(len * 4, strlen(QQ_NULL_MSG)) + 1;
+}
+
+/*
+ * convert all slices with one converter into one block
+ * the str of every slice points into the returned block, g_free it after use
+ * a slice failed to be converted gets QQ_NULL_MSG
+ */
+gchar *qq_convert_batch(qq_conv_slice *slices, gint count, const gchar *to_charset, const gchar *from_charset)
+{
+	GIConv cd = (GIConv) -1;
+	gboolean keeps_ascii;
+	gchar *block, *p, *inbuf, *outbuf;
+	gsize block_size, used, inleft, outleft;
+	gint i;
+
+	g_return_val_if_fail(slices != NULL && count >= 0, NULL);
+	g_return_val_if_fail(to_charset != NULL && from_charset != NULL, NULL);
+
+	block_size = 0;
+	for (i = 0; i < count; i++) {
+		block_size += batch_slice_room(slices[i].len);
+	}
+	block = g_malloc(MAX(block_size, 1));
+
+	keeps_ascii = charset_keeps_ascii(to_charset) && charset_keeps_ascii(from_charset);
+	used = 0;
+	for (i = 0; i < count; i++) {
+		inbuf = (gchar *) slices[i].data;
+		inleft = slices[i].len;
+		outbuf = block + used;
+		outleft = batch_slice_room(inleft) - 1;
+
+		if (inleft == 0 || (keeps_ascii && str_is_ascii(inbuf, inleft))) {
+			memcpy(outbuf, inbuf, inleft);
+			outbuf += inleft;
+		} else {
+			if (cd == (GIConv) -1) {
+				cd = conv_get(to_charset, from_charset);
+			} else {
+				g_iconv(cd, NULL, NULL, NULL, NULL);
+			}
+			if (cd == (GIConv) -1
+					|| g_iconv(cd, &inbuf, &inleft, &outbuf, &outleft) == (gsize) -1) {
+				purple_debug_error("QQ_CONVERT", "Failed to convert slice %d from %s to %s\n",
+						i, from_charset, to_charset);
+				qq_show_packet("Dump failed text", slices[i].data, slices[i].len);
+				outbuf = block + used;
+				memcpy(outbuf, QQ_NULL_MSG, strlen(QQ_NULL_MSG));
+				outbuf += strlen(QQ_NULL_MSG);
+			}
+		}
+		*outbuf = '\0';
+		slices[i].str_len = outbuf - (block + used);
+		used += slices[i].str_len + 1;
+	}
+
+	/* give back the unused room, then point slices into the final block */
+	block = g_realloc(block, MAX(used, 1));
+	p = block;
+	for (i = 0; i < count; i++) {
+		slices[i].str = p;
+		p += slices[i].str_len + 1;
+	}
+	return block;
+}
+
 /*
  * Changed!!!! Check Every Invoke!!!!
  * take the input as a pascal string and return a converted c-string in UTF-8
@@ -99,6 +290,7 @@ gint qq_put_vstr( guint8 *buf, const gchar *str_utf8, gsize len_size, const gcha
 {
 	gchar *str;
 	guint32 len;
+	gsize out_len;
 	guint i;
 
 
@@ -107,8 +299,10 @@ gint qq_put_vstr( guint8 *buf, const gchar *str_utf8, gsize len_size, const gcha
 		len = strlen(str_utf8);
 
 		if (to_charset) {
-			str = do_convert(str_utf8, -1, &len, to_charset, UTF8);
+			str = do_convert(str_utf8, -1, &out_len, to_charset, UTF8);
+			len = out_len;
 			if (len > 0)	g_memmove(buf + len_size, str, len);
+			g_free(str);
 		}
 		else	g_memmove(buf + len_size, str_utf8, len);
 	}
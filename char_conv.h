@@ -32,10 +32,23 @@
 #define QQ_CHARSET_ZH_CN      "GB18030"
 #define QQ_CHARSET_ENG        "ISO-8859-1"
 
+/* a string in packet and its converted copy */
+typedef struct _qq_conv_slice {
+	const guint8 *data;
+	gsize len;
+	const gchar *str;		/* 0x00 ended, points into block of qq_convert_batch */
+	gsize str_len;
+} qq_conv_slice;
+
 gint qq_get_vstr(gchar **ret, const gchar *from_charset, gsize len_size, guint8 *data);
 gint qq_put_vstr(guint8 *buf, const gchar *str_utf8, gsize len_size, const gchar *to_charset);
 
 gchar *utf8_to_qq(const gchar *str, const gchar *to_charset);
 gchar *qq_to_utf8(const gchar *str, const gchar *from_charset);
 
+gchar *qq_convert_batch(qq_conv_slice *slices, gint count, const gchar *to_charset, const gchar *from_charset);
+
+/* close cached converters, called when plugin is unloaded */
+void qq_conv_cache_free(void);
+
 #endif
@@ -38,6 +38,8 @@
 #include "group_im.h"
 #include "group_opt.h"
 #include "im.h"
+#include "im_fragment.h"
+#include "im_segment.h"
 #include "qq_define.h"
 #include "packet_parse.h"
 #include "qq_network.h"
@@ -205,7 +207,10 @@ void qq_room_got_chat_in(PurpleConnection *gc,
 /* recv an IM from a group chat */
 void qq_process_room_im(guint8 *data, gint data_len, guint32 id, PurpleConnection *gc, guint16 msg_type)
 {
-	gchar *msg_smiley, *msg_fmt, *msg_utf8, *msg_escaped;
+	gchar *msg_smiley, *msg_utf8 = NULL;
+	const gchar *text = NULL;
+	gsize text_len = 0;
+	qq_im_frag_info frag;
 	gint bytes, tail_len;
 	struct {
 		guint32 qun_id;
@@ -219,14 +224,9 @@ void qq_process_room_im(guint8 *data, gint data_len, guint32 id, PurpleConnectio
 	} im_text;
 	guint32 temp_id;
 	guint8 has_font_attr;
-	guint8 frag_count, frag_index;
-	guint16 msg_id;
+	guint8 frag_count = 0, frag_index = 0;
+	guint16 msg_id = 0;
 	qq_im_format *fmt = NULL;
-	guint8 type;
-	guint8 * msg_data;
-	gchar * text;
-	gchar emoticon;
-	gchar * purple_smiley;
 
 	/* at least include im_text.msg_len */
 	g_return_if_fail(data != NULL && data_len > 23);
@@ -303,55 +303,9 @@ void qq_process_room_im(guint8 *data, gint data_len, guint32 id, PurpleConnectio
 
 			bytes += 2;
 			im_text.msg = g_string_new("");
-			while (bytes < data_len) {
-				bytes += qq_get8(&type, data+bytes);
-				bytes += qq_get_vstr(&msg_data, NULL, sizeof(guint16), data+bytes);
-				//bytes += msg_dataseg_len = qq_get_vstr(&msg_data, NULL, sizeof(guint16), data+bytes);
-				//msg_dataseg_len -= sizeof(guint16);
-
-				switch (type) {
-				case 0x01:	//text
-					qq_get_vstr(&text, NULL, sizeof(guint16), msg_data+1);		//+1 bypass msg_dataseg_flag 0x01
-					g_free(msg_data);
-					g_string_append(im_text.msg, text);
-					g_free(text);
-					break;
-				case 0x02:	//emoticon
-					emoticon = *(msg_data+8);
-					/* remained Unknown data is FF 00 02 14 XX ;old emoticon index */
-					g_free(msg_data);
-					purple_smiley = emoticon_get(emoticon);
-					if (purple_smiley == NULL) {
-						purple_debug_info("QQ", "Not found smiley of 0x%02X\n", emoticon);
-						g_string_append(im_text.msg, "/v$");
-					} else {
-						purple_debug_info("QQ", "Found 0x%02X smiley is %s\n", emoticon, purple_smiley);
-						g_string_append(im_text.msg, purple_smiley);
-					}
-					break;
-				case 03:	//image
-					break;
-					/*		it's kinda complicated, TOFIX later
-					msg_dataseg_pos = 0;
-					while (msg_dataseg_pos < msg_dataseg_len)
-					{
-						msg_dataseg_pos = qq_get8(&msg_dataseg_flag, msg_data);
-						switch (msg_dataseg_flag)
-						{
-						case 0x0:
-							break;
-						}
-					}	*/	
-				}
-			}
-			msg_escaped = purple_markup_escape_text(im_text.msg->str, im_text.msg->len);
-			if (fmt != NULL) {
-				msg_utf8 = qq_im_fmt_to_purple(fmt, g_string_new(msg_escaped));
-				qq_im_fmt_free(fmt);
-				g_free(msg_escaped);
-			} else {
-				msg_utf8 =  msg_escaped;
-			}
+			qq_im_seg_to_text(im_text.msg, data + bytes, data_len - bytes);
+			text = im_text.msg->str;
+			text_len = im_text.msg->len;
 			break;
 		}
 	case QQ_MSG_ROOM_IM_UNKNOWN:
@@ -368,29 +322,32 @@ void qq_process_room_im(guint8 *data, gint data_len, guint32 id, PurpleConnectio
 
 			msg_smiley = qq_emoticon_to_purple(im_text.msg->str);
 			msg_utf8 = qq_to_utf8(msg_smiley, QQ_CHARSET_DEFAULT);
-			msg_escaped = purple_markup_escape_text(msg_utf8, -1);
-
-			if (fmt != NULL) {
-				msg_fmt = qq_im_fmt_to_purple(fmt, g_string_new(msg_escaped));
-				g_free(msg_escaped);
-				g_free(msg_utf8);
-				msg_utf8 =  msg_fmt;
-				qq_im_fmt_free(fmt);
-				g_free(msg_smiley);
-			} else {
-				g_free(msg_utf8);
-				msg_utf8 =  msg_smiley;
-			}
+			g_free(msg_smiley);
+			text = msg_utf8;
+			text_len = strlen(msg_utf8);
 			break;
 		}
 	}
 
-	purple_debug_info("QQ", "Room (%u) IM from %u: %s\n",
-			im_text.qun_id, im_text.member_uid, msg_utf8);
- 	qq_room_got_chat_in(gc, id, im_text.member_uid, msg_utf8, im_text.send_time);
+	if (text != NULL) {
+		/* long message is delivered once all its fragments arrived */
+		memset(&frag, 0, sizeof(frag));
+		frag.is_room = TRUE;
+		frag.id = id;
+		frag.from = im_text.member_uid;
+		frag.msg_id = msg_id;
+		frag.count = frag_count;
+		frag.index = frag_index;
+		frag.send_time = im_text.send_time;
+		qq_im_frag_add(gc, &frag, text, text_len, fmt);
+	} else if (fmt != NULL) {
+		qq_im_fmt_free(fmt);
+	}
 
 	g_free(msg_utf8);
-	g_string_free(im_text.msg, TRUE);
+	if (im_text.msg != NULL) {
+		g_string_free(im_text.msg, TRUE);
+	}
 }
 
 /* send IM to a group */
@@ -482,7 +439,7 @@ int qq_chat_send(PurpleConnection *gc, int id, const char *what, PurpleMessageFl
 	}
 
 	is_smiley_none = qq_im_smiley_none(what);
-	segments = qq_im_get_segments(msg_stripped, is_smiley_none);
+	segments = qq_im_get_segments(gc, msg_stripped, is_smiley_none);
 	g_free(msg_stripped);
 
 	if (segments == NULL) {
@@ -368,18 +368,26 @@ void qq_process_room_cmd_get_onlines(guint8 *data, gint len, PurpleConnection *g
 	qq_room_conv_set_onlines(gc, rmd);
 }
 
+/* uid, face, age, gender, nick length, then unknown, ext_flag and comm_flag after nick */
+#define QQ_ROOM_MEMBER_INFO_FIXED	13
+
 /* process the reply to get_members_info packet */
 void qq_process_room_cmd_get_members_info( guint8 *data, gint len, guint32 index, PurpleConnection *gc )
 {
 	gint bytes;
-	gint num;
+	gint num, count, i;
 	guint32 id, member_uid;
 	guint16 unknown;
+	guint8 nick_len;
+	qq_data *qd;
 	qq_room_data *rmd;
 	qq_buddy_data *bd;
+	qq_conv_slice *nicks;
+	gchar *nicks_block;
 	gchar *nick;
 
 	g_return_if_fail(data != NULL && len > 0);
+	qd = (qq_data *) gc->proto_data;
 
 	/* qq_show_packet("qq_process_room_cmd_get_members_info", data, len); */
 
@@ -390,27 +398,54 @@ void qq_process_room_cmd_get_members_info( guint8 *data, gint len, guint32 index
 	rmd = qq_room_data_find(gc, id);
 	g_return_if_fail(rmd != NULL);
 
-	num = 0;
+	/* collect all nicknames first, they are converted from GB18030 together */
+	nicks = g_new(qq_conv_slice, (len - bytes) / QQ_ROOM_MEMBER_INFO_FIXED + 1);
+	count = 0;
+	while (bytes + QQ_ROOM_MEMBER_INFO_FIXED <= len) {
+		nick_len = data[bytes + 8];
+		if (bytes + QQ_ROOM_MEMBER_INFO_FIXED + nick_len > len) {
+			break;
+		}
+		nicks[count].data = data + bytes + 9;
+		nicks[count].len = nick_len;
+		count++;
+		bytes += QQ_ROOM_MEMBER_INFO_FIXED + nick_len;
+	}
+	if (bytes != len) {
+		purple_debug_error("QQ",
+				"group_cmd_get_members_info: Dangerous error! maybe protocol changed, notify developers!");
+	}
+	/* only here use old charset GB18030 */
+	nicks_block = qq_convert_batch(nicks, count, UTF8, QQ_CHARSET_DEFAULT);
 
-	while (bytes < len) {
+	bytes = 4;
+	num = 0;
+	for (i = 0; i < count; i++) {
 		bytes += qq_get32(&member_uid, data + bytes);
-		g_return_if_fail(member_uid > 0);
+		if (member_uid == 0) {
+			break;
+		}
 		bd = qq_room_buddy_find_or_new(gc, rmd, member_uid);
-		g_return_if_fail(bd != NULL);
+		if (bd == NULL) {
+			break;
+		}
 
 		num++;
 		bytes += qq_get16(&(bd->face), data + bytes);
 		bytes += qq_get8(&(bd->age), data + bytes);
 		bytes += qq_get8(&(bd->gender), data + bytes);
-		/* only here use old charset GB18030 */
-		bytes += qq_get_vstr(&nick, QQ_CHARSET_DEFAULT, sizeof(guint8), data + bytes);
+		bytes += 1 + nicks[i].len;
 		bytes += qq_get16(&unknown, data + bytes);
 		bytes += qq_get8(&(bd->ext_flag), data + bytes);
 		bytes += qq_get8(&(bd->comm_flag), data + bytes);
 
+		/* filter inside the block, only allocate when nickname is changed */
+		nick = (gchar *) nicks[i].str;
 		qq_filter_str(nick);
-		bd->nickname = g_strdup(nick);
-		g_free(nick);
+		if (bd->nickname == NULL || strcmp(bd->nickname, nick) != 0) {
+			qq_str_unref(bd->nickname);
+			bd->nickname = qq_str_intern(qd->str_pool, nick);
+		}
 
 #if 0
 		purple_debug_info("QQ",
@@ -420,10 +455,8 @@ void qq_process_room_cmd_get_members_info( guint8 *data, gint len, guint32 index
 
 		bd->last_update = time(NULL);
 	}
-	if (bytes > len) {
-		purple_debug_error("QQ",
-				"group_cmd_get_members_info: Dangerous error! maybe protocol changed, notify developers!");
-	}
+	g_free(nicks_block);
+	g_free(nicks);
 	purple_debug_info("QQ", "Group \"%s\" got %d member info\n", rmd->name, num);
 
 	if (index)
@@ -253,6 +253,7 @@ void qq_room_buddy_remove(qq_room_data *rmd, guint32 uid)
 
 qq_buddy_data *qq_room_buddy_find_or_new(PurpleConnection *gc, qq_room_data *rmd, guint32 member_uid)
 {
+	qq_data *qd = (qq_data *) gc->proto_data;
 	qq_buddy_data *member, *bd;
 	PurpleBuddy *buddy;
 	gchar * member_name;
@@ -270,9 +271,9 @@ qq_buddy_data *qq_room_buddy_find_or_new(PurpleConnection *gc, qq_room_data *rmd
 
 			bd = purple_buddy_get_protocol_data(buddy);
 			if (bd != NULL && bd->nickname != NULL)
-				member->nickname = g_strdup(bd->nickname);
+				member->nickname = qq_str_ref(bd->nickname);
 			else if ((alias = purple_buddy_get_alias(buddy)) != NULL)
-				member->nickname = g_strdup(alias);
+				member->nickname = qq_str_intern(qd->str_pool, alias);
 		}
 		rmd->members = g_list_append(rmd->members, member);
 	}
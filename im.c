@@ -37,6 +37,8 @@
 #include "char_conv.h"
 #include "qq_define.h"
 #include "im.h"
+#include "im_fragment.h"
+#include "im_segment.h"
 #include "packet_parse.h"
 #include "qq_network.h"
 #include "send_file.h"
@@ -101,16 +103,7 @@ struct _qq_emoticon {
 	gchar *name;
 };
 
-typedef struct _qq_image qq_image;
-struct _qq_image {
-	guint8 id;
-	gchar *filename;
-	guint image_size;
-	gpointer *image_data;
-};
-
-static gboolean emoticons_is_sorted = FALSE;
-/* Map for purple smiley convert to qq, need qsort */
+/* Map for purple smiley convert to qq, compiled into emoticon_trie */
 static qq_emoticon emoticons[] = {
 	{0x4f, 0x0E, "/:)$"},      {0x4f, 0x0E, "/wx$"},      {0x4f, 0x0E, "/small_smile$"},
 	{0x42, 0x01, "/:~$"},      {0x42, 0x01, "/pz$"},      {0x42, 0x01, "/curl_lip$"},
@@ -394,111 +387,151 @@ static qq_emoticon emoticons_sym[] = {
 };
 gint emoticons_sym_num = sizeof(emoticons_sym) / sizeof(qq_emoticon) - 1;;
 
-static int emoticon_cmp(const void *k1, const void *k2)
+/* one char of emoticon names, children are linked by sibling */
+typedef struct _qq_emoticon_node {
+	gchar c;
+	gint16 child;		/* first child, -1 if none */
+	gint16 sibling;		/* next child of parent, -1 if none */
+	gint16 emoticon;	/* index of name ending here, -1 if none */
+} qq_emoticon_node;
+
+static qq_emoticon_node *emoticon_trie;		/* node 0 is root */
+static GOnce emoticon_trie_once = G_ONCE_INIT;
+
+static gpointer emoticon_trie_build(gpointer data)
 {
-	const qq_emoticon *e1 = (const qq_emoticon *) k1;
-	const qq_emoticon *e2 = (const qq_emoticon *) k2;
-	if (e1->symbol == 0) {
-		/* purple_debug_info("QQ", "emoticon_cmp len %d\n", strlen(e2->name)); */
-		return strncmp(e1->name, e2->name, strlen(e2->name));
+	gint len, i, node, next;
+	const gchar *c;
+
+	/* no more nodes than chars of all names */
+	len = 1;
+	for (i = 0; i < emoticons_num; i++) {
+		len += strlen(emoticons[i].name);
 	}
-	if (e2->symbol == 0) {
-		/* purple_debug_info("QQ", "emoticon_cmp len %d\n", strlen(e1->name)); */
-		return strncmp(e1->name, e2->name, strlen(e1->name));
+	g_return_val_if_fail(len < G_MAXINT16, NULL);
+
+	emoticon_trie = g_new(qq_emoticon_node, len);
+	emoticon_trie[0].c = '\0';
+	emoticon_trie[0].child = emoticon_trie[0].sibling = emoticon_trie[0].emoticon = -1;
+	len = 1;
+
+	for (i = 0; i < emoticons_num; i++) {
+		node = 0;
+		for (c = emoticons[i].name; *c != '\0'; c++) {
+			for (next = emoticon_trie[node].child; next >= 0; next = emoticon_trie[next].sibling) {
+				if (emoticon_trie[next].c == *c)	break;
+			}
+			if (next < 0) {
+				next = len++;
+				emoticon_trie[next].c = *c;
+				emoticon_trie[next].child = emoticon_trie[next].emoticon = -1;
+				emoticon_trie[next].sibling = emoticon_trie[node].child;
+				emoticon_trie[node].child = next;
+			}
+			node = next;
+		}
+		/* first one wins if names repeat */
+		if (emoticon_trie[node].emoticon < 0) {
+			emoticon_trie[node].emoticon = i;
+		}
 	}
-	return strcmp(e1->name, e2->name);
+	return emoticon_trie;
 }
 
-static void emoticon_try_sort()
+/* longest emoticon name at the begin of text, NULL if none */
+static qq_emoticon *emoticon_match(const gchar *text)
 {
-	if (emoticons_is_sorted)
-		return;
+	gint node, match;
 
-	purple_debug_info("QQ", "qsort stand emoticons\n");
-	qsort(emoticons, emoticons_num, sizeof(qq_emoticon), emoticon_cmp);
-	emoticons_is_sorted = TRUE;
-}
+	g_return_val_if_fail(text != NULL, NULL);
+	if (g_once(&emoticon_trie_once, emoticon_trie_build, NULL) == NULL) {
+		return NULL;
+	}
 
-static qq_emoticon *emoticon_find(gchar *name)
-{
-	qq_emoticon *ret = NULL;
-	qq_emoticon key;
+	match = -1;
+	node = 0;
+	for (; *text != '\0'; text++) {
+		for (node = emoticon_trie[node].child; node >= 0; node = emoticon_trie[node].sibling) {
+			if (emoticon_trie[node].c == *text)	break;
+		}
+		if (node < 0)	break;
+		if (emoticon_trie[node].emoticon >= 0) {
+			match = emoticon_trie[node].emoticon;
+		}
+	}
+	return (match >= 0) ? &emoticons[match] : NULL;
+}
 
-	g_return_val_if_fail(name != NULL, NULL);
-	emoticon_try_sort();
+/* purple smiley of each qq symbol, from emoticons_sym then emoticons */
+static const gchar *emoticon_names[256];
+static gsize emoticon_name_max;
+static GOnce emoticon_names_once = G_ONCE_INIT;
 
-	key.name = name;
-	key.symbol = 0;
+static gpointer emoticon_names_build(gpointer data)
+{
+	gint i;
 
-	/* purple_debug_info("QQ", "bsearch emoticon %.20s\n", name); */
-	ret = (qq_emoticon *)bsearch(&key, emoticons, emoticons_num,
-			sizeof(qq_emoticon), emoticon_cmp);
-	return ret;
+	for (i = 0; i < emoticons_sym_num; i++) {
+		if (emoticon_names[emoticons_sym[i].symbol] == NULL) {
+			emoticon_names[emoticons_sym[i].symbol] = emoticons_sym[i].name;
+		}
+	}
+	for (i = 0; i < emoticons_num; i++) {
+		if (emoticon_names[emoticons[i].symbol] == NULL) {
+			emoticon_names[emoticons[i].symbol] = emoticons[i].name;
+		}
+	}
+	for (i = 0; i < 256; i++) {
+		if (emoticon_names[i] != NULL) {
+			emoticon_name_max = MAX(emoticon_name_max, strlen(emoticon_names[i]));
+		}
+	}
+	return emoticon_names;
 }
 
 gchar *emoticon_get(guint8 symbol)
 {
-	g_return_val_if_fail(symbol >= emoticons_sym[0].symbol, NULL);
-	g_return_val_if_fail(symbol <= emoticons_sym[emoticons_sym_num - 1].symbol, NULL);
-
-	return emoticons_sym[symbol - emoticons_sym[0].symbol].name;
+	g_once(&emoticon_names_once, emoticon_names_build, NULL);
+	return (gchar *) emoticon_names[symbol];
 }
 
 /* convert qq emote icon to purple sytle
-   Notice: text is in qq charset, GB18030 or utf8 */
-gchar *qq_emoticon_to_purple(gchar *text)
+   Notice: text is in qq charset, GB18030 or utf8,
+   where 0x14 and 0x15 are never part of a multibyte char */
+gchar *qq_emoticon_to_purple(const gchar *text)
 {
-	gchar *ret;
-	GString *converted;
-	gchar **segments;
-	gchar *purple_smiley;
-	gchar *cur;
-	guint8 symbol;
-
-	/* qq_show_packet("text", (guint8 *)text, strlen(text)); */
-	g_return_val_if_fail(text != NULL && strlen(text) != 0, g_strdup(""));
+	static const gchar unknown[] = "<IMG ID=\"0\">";
+	const gchar *cur, *name;
+	gchar *ret, *out;
+	gsize len, name_len;
 
-	while ((cur = strchr(text, '\x14')) != NULL)
-		*cur = '\x15';
+	g_return_val_if_fail(text != NULL && text[0] != '\0', g_strdup(""));
+	g_once(&emoticon_names_once, emoticon_names_build, NULL);
 
-	segments = g_strsplit(text, "\x15", 0);
-	if(segments == NULL) {
-		return g_strdup("");
-	}
+	/* every 2 bytes of input may become one smiley */
+	len = strlen(text);
+	ret = out = g_malloc(len + (len / 2 + 1) * MAX(emoticon_name_max, sizeof(unknown)) + 1);
 
-	converted = g_string_new("");
-	if (segments[0] != NULL) {
-		g_string_append(converted, segments[0]);
-	} else {
-		purple_debug_info("QQ", "segments[0] is NULL\n");
-	}
-	while ((*(++segments)) != NULL) {
-		cur = *segments;
-		if (cur == NULL) {
-			purple_debug_info("QQ", "current segment is NULL\n");
-			break;
+	for (cur = text; *cur != '\0'; cur++) {
+		if (*cur != '\x14' && *cur != '\x15') {
+			*out++ = *cur;
+			continue;
 		}
-		if (strlen(cur) == 0) {
-			purple_debug_info("QQ", "current segment length is 0\n");
-			break;
+		/* symbol follows the flag */
+		if (cur[1] == '\0')	break;
+		if (cur[1] == '\x14' || cur[1] == '\x15')	continue;
+
+		cur++;
+		name = emoticon_names[(guint8) *cur];
+		if (name == NULL) {
+			purple_debug_info("QQ", "Not found smiley of 0x%02X\n", (guint8) *cur);
+			name = unknown;
 		}
-		symbol = (guint8)cur[0];
-
-		purple_smiley = emoticon_get(symbol);
-		if (purple_smiley == NULL) {
-			purple_debug_info("QQ", "Not found smiley of 0x%02X\n", symbol);
-			g_string_append(converted, "<IMG ID=\"0\">");
-		} else {
-			purple_debug_info("QQ", "Found 0x%02X smiley is %s\n", symbol, purple_smiley);
-			g_string_append(converted, purple_smiley);
-			g_string_append(converted, cur + 1);
-		}
-		/* purple_debug_info("QQ", "next segment\n"); */
+		name_len = strlen(name);
+		memcpy(out, name, name_len);
+		out += name_len;
 	}
-
-	/* purple_debug_info("QQ", "end of convert\n"); */
-	ret = converted->str;
-	g_string_free(converted, FALSE);
+	*out = '\0';
 	return ret;
 }
 
@@ -583,88 +616,182 @@ qq_im_format *qq_im_fmt_new_by_purple(const gchar *msg)
 	return fmt;
 }
 
-/* convert qq format to purple */
-gchar * qq_im_fmt_to_purple( qq_im_format *fmt, GString *text )
+/* bytes of all tags but font face, "<u><i><b>" with three "<font ...>" and their ends */
+#define QQ_IM_FMT_TAGS_MAX	128
+
+static gsize markup_escaped_len(const gchar *text, gsize len)
 {
-	GString *tmp;
-	gchar *ret;
-
-	tmp = g_string_new("");
-	g_string_append_printf(tmp, "<font color=\"#%02x%02x%02x\">",
-		fmt->rgb[0], fmt->rgb[1], fmt->rgb[2]);
-	g_string_prepend(text, tmp->str);
-	g_string_set_size(tmp, 0);
-	g_string_append(text, "</font>");
-
-	if (fmt->font != NULL) {
-		g_string_append_printf(tmp, "<font face=\"%s\">", fmt->font);
-		g_string_prepend(text, tmp->str);
-		g_string_set_size(tmp, 0);
-		g_string_append(text, "</font>");
+	gsize i, escaped_len = len;
+
+	for (i = 0; i < len; i++) {
+		switch (text[i]) {
+			case '&':
+				escaped_len += 4;		/* &amp; */
+				break;
+			case '<':
+			case '>':
+				escaped_len += 3;		/* &lt; &gt; */
+				break;
+			case '"':
+			case '\'':
+				escaped_len += 5;		/* &quot; &apos; */
+				break;
+			default:
+				break;
+		}
 	}
-	if (fmt->font_size >= 0) {
-		g_string_append_printf(tmp, "<font size=\"%d\">", ((fmt->font_size-1)&3) ? (fmt->font_size+1)/3 : (fmt->font_size-1)/3);	//fix the difference in size
-		g_string_prepend(text, tmp->str);
-		g_string_set_size(tmp, 0);
-		g_string_append(text, "</font>");
+	return escaped_len;
+}
+
+static void markup_escape_to(gchar *dst, const gchar *text, gsize len)
+{
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		switch (text[i]) {
+			case '&':
+				memcpy(dst, "&amp;", 5);
+				dst += 5;
+				break;
+			case '<':
+				memcpy(dst, "&lt;", 4);
+				dst += 4;
+				break;
+			case '>':
+				memcpy(dst, "&gt;", 4);
+				dst += 4;
+				break;
+			case '"':
+				memcpy(dst, "&quot;", 6);
+				dst += 6;
+				break;
+			case '\'':
+				memcpy(dst, "&apos;", 6);
+				dst += 6;
+				break;
+			default:
+				*dst++ = text[i];
+				break;
+		}
 	}
-	if (fmt->attr & 0x01) {
-		/* bold */
-		g_string_prepend(text, "<b>");
-		g_string_append(text, "</b>");
+}
+
+/* escape utf8 text and wrap it with tags of qq format, fmt could be NULL */
+gchar *qq_im_fmt_to_purple(qq_im_format *fmt, const gchar *text, gssize len)
+{
+	GString *str;
+	gsize body_len, pos;
+	gint fonts = 0;
+
+	g_return_val_if_fail(text != NULL, NULL);
+
+	if (len < 0) {
+		len = strlen(text);
 	}
-	if (fmt->attr & 0x02) {
-		/* italic */
-		g_string_prepend(text, "<i>");
-		g_string_append(text, "</i>");
+	body_len = markup_escaped_len(text, len);
+	str = g_string_sized_new(body_len + QQ_IM_FMT_TAGS_MAX
+			+ ((fmt != NULL && fmt->font != NULL) ? strlen(fmt->font) : 0));
+
+	if (fmt != NULL) {
+		if (fmt->attr & 0x04) {
+			/* underline */
+			g_string_append(str, "<u>");
+		}
+		if (fmt->attr & 0x02) {
+			/* italic */
+			g_string_append(str, "<i>");
+		}
+		if (fmt->attr & 0x01) {
+			/* bold */
+			g_string_append(str, "<b>");
+		}
+		g_string_append_printf(str, "<font size=\"%d\">", ((fmt->font_size-1)&3) ? (fmt->font_size+1)/3 : (fmt->font_size-1)/3);	//fix the difference in size
+		fonts++;
+		if (fmt->font != NULL) {
+			g_string_append_printf(str, "<font face=\"%s\">", fmt->font);
+			fonts++;
+		}
+		g_string_append_printf(str, "<font color=\"#%02x%02x%02x\">",
+			fmt->rgb[0], fmt->rgb[1], fmt->rgb[2]);
+		fonts++;
 	}
-	if (fmt->attr & 0x04) {
-		/* underline */
-		g_string_prepend(text, "<u>");
-		g_string_append(text, "</u>");
+
+	pos = str->len;
+	g_string_set_size(str, pos + body_len);
+	markup_escape_to(str->str + pos, text, len);
+
+	if (fmt != NULL) {
+		while (fonts-- > 0) {
+			g_string_append(str, "</font>");
+		}
+		if (fmt->attr & 0x01) {
+			g_string_append(str, "</b>");
+		}
+		if (fmt->attr & 0x02) {
+			g_string_append(str, "</i>");
+		}
+		if (fmt->attr & 0x04) {
+			g_string_append(str, "</u>");
+		}
 	}
+	return g_string_free(str, FALSE);
+}
 
-	
-	ret = text->str;
-	g_string_free(tmp, TRUE);
-	g_string_free(text, FALSE);
-	return ret;
+#define QQ_IMAGE_NAMES_MAX	64
+
+/* file name of an image is md5 of its data, computed once per imgstore id */
+static const gchar *image_filename(qq_data *qd, gint id, PurpleStoredImage *image)
+{
+	gchar *filename;
+	gchar md5[33];
+
+	if (qd->image_names == NULL) {
+		qd->image_names = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	}
+
+	filename = g_hash_table_lookup(qd->image_names, GINT_TO_POINTER(id));
+	if (filename != NULL) {
+		return filename;
+	}
+
+	if (g_hash_table_size(qd->image_names) >= QQ_IMAGE_NAMES_MAX) {
+		g_hash_table_remove_all(qd->image_names);
+	}
+	qq_get_md5_str((guint8 *) md5, sizeof(md5),
+			purple_imgstore_get_data(image), purple_imgstore_get_size(image));
+	filename = g_strconcat(md5, ".", purple_imgstore_get_extension(image), NULL);
+	g_hash_table_insert(qd->image_names, GINT_TO_POINTER(id), filename);
+	return filename;
 }
 
-static qq_image *image_find(gchar *pos)
+/* image tag turned into "/img id=...$" by qq_send_im
+ * return file name of the image, kept by qq_data */
+static const gchar *image_find(qq_data *qd, gchar *pos)
 {
-	gchar *end, *str, *id, *start, *filename, *fileext;
-	guint8 *md5;
+	gchar *end, *str, *id, *start;
 	GData *attr;
 	PurpleStoredImage *image;
-	qq_image *img = g_new0(qq_image, 1);
+	const gchar *filename = NULL;
 
-	
-	if (g_ascii_strcasecmp(pos, "/IMG") && (end = g_utf8_strchr(pos, 14, '$')))
+	if (g_ascii_strncasecmp(pos, "/IMG", 4) != 0 || (end = g_utf8_strchr(pos, 14, '$')) == NULL) {
+		return NULL;
+	}
+
+	str = g_strndup(pos, end - pos + 1);
+	*str = '<';
+	*(str+(end-pos)) = '>';
+
+	if (purple_markup_find_tag("IMG", str, &start, &end, &attr))
 	{
-		str = g_strndup(pos, end - pos + 1);
-		*str = '<';
-		*(str+(end-pos)) = '>';
-		
-		if (purple_markup_find_tag("IMG", str, &start, &end, &attr))
+		id = g_datalist_get_data(&attr, "id");
+		if (id && (image = purple_imgstore_find_by_id(atoi(id))))
 		{
-			id = g_datalist_get_data(&attr, "id");
-			img->id = atoi(id);
-			if (id && (image = purple_imgstore_find_by_id(img->id))) 
-			{
-				img->image_size = purple_imgstore_get_size(image);
-				img->image_data = purple_imgstore_get_data(image);
-				filename = g_alloca(33);
-				qq_get_md5_str(filename, 33, img->image_data, img->image_size);
-				fileext = purple_imgstore_get_extension(image);
-				img->filename = g_strconcat(filename, ".", fileext, NULL);
-				g_free(fileext);
-			}
-			g_datalist_clear(&attr);
-			return img;
+			filename = image_filename(qd, atoi(id), image);
 		}
+		g_datalist_clear(&attr);
 	}
-	return NULL;
+	g_free(str);
+	return filename;
 }
 
 /* data includes text msg and font attr*/
@@ -762,8 +889,7 @@ static void process_im_vibrate(PurpleConnection *gc, guint8 *data, gint len, qq_
 	buddy = purple_find_buddy(gc->account, who);
 	bd = (buddy == NULL) ? NULL : purple_buddy_get_protocol_data(buddy);
 	if (bd != NULL) {
-		bd->face = im_text.sender_icon;
-		qq_update_buddy_icon(gc->account, who, bd->face);
+		qq_update_buddy_face(gc->account, who, bd, im_text.sender_icon);
 	}
 
 	fmt = qq_im_fmt_new_default();
@@ -780,19 +906,14 @@ static void process_im_text(PurpleConnection *gc, guint8 *data, gint len, qq_im_
 {
 	guint16 purple_msg_flag;
 	gchar *who;
-	gchar *msg_smiley, *msg_fmt, *msg_utf8, *msg_escaped;
+	gchar *msg_smiley, *msg_utf8 = NULL;
+	const gchar *text = NULL;
+	gsize text_len = 0;
+	qq_im_frag_info frag;
 	PurpleBuddy *buddy;
 	qq_buddy_data *bd;
 	gint bytes, tail_len;
 	qq_im_format *fmt = NULL;
-	guint8 type;
-	guint8 *msg_data;
-	//guint msg_dataseg_len;
-	//guint8 msg_dataseg_flag;
-	//guint msg_dataseg_pos;
-	gchar *text;
-	gchar emoticon;
-	gchar *purple_smiley;
 
 	struct {
 		guint16 msg_seq;
@@ -835,8 +956,7 @@ static void process_im_text(PurpleConnection *gc, guint8 *data, gint len, qq_im_
 	bd = (buddy == NULL) ? NULL : purple_buddy_get_protocol_data(buddy);
 	if (bd != NULL) {
 		bd->client_tag = im_header->version_from;
-		bd->face = im_text.sender_icon;
-		qq_update_buddy_icon(gc->account, who, bd->face);
+		qq_update_buddy_face(gc->account, who, bd, im_text.sender_icon);
 	}
 
 	purple_msg_flag = (im_text.auto_reply == QQ_IM_AUTO_REPLY)
@@ -872,57 +992,9 @@ static void process_im_text(PurpleConnection *gc, guint8 *data, gint len, qq_im_
 
 			bytes += 2;
 			im_text.msg = g_string_new("");
-			while (bytes < len) {
-				bytes += qq_get8(&type, data+bytes);
-				bytes += qq_get_vstr(&msg_data, NULL, sizeof(guint16), data+bytes);
-				//bytes += msg_dataseg_len = qq_get_vstr(&msg_data, NULL, sizeof(guint16), data+bytes);
-				//msg_dataseg_len -= sizeof(guint16);
-
-				switch (type) {
-				case 0x01:	//text
-					qq_get_vstr(&text, NULL, sizeof(guint16), msg_data+1);		//+1 bypass msg_dataseg_flag 0x01
-					g_string_append(im_text.msg, text);
-					g_free(msg_data);
-					g_free(text);
-					break;
-				case 0x02:	//emoticon
-					emoticon = *(msg_data+8);
-					/* 01 00 01(sizeof INDEX) INDEX(new) FF 00 02(sizeof SYM) 14 SYM(old) */
-					g_free(msg_data);
-					purple_smiley = emoticon_get(emoticon);
-					if (purple_smiley == NULL) {
-						purple_debug_info("QQ", "Not found smiley of 0x%02X\n", emoticon);
-						g_string_append(im_text.msg, "/v$");
-					} else {
-						purple_debug_info("QQ", "Found 0x%02X smiley is %s\n", emoticon, purple_smiley);
-						g_string_append(im_text.msg, purple_smiley);
-					}
-					break;
-				case 03:	//image
-					break;
-					/*		TODO: it's kinda complicated, fix it later
-					msg_dataseg_pos = 0;
-					while (msg_dataseg_pos < msg_dataseg_len)
-					{
-						msg_dataseg_pos = qq_get8(&msg_dataseg_flag, msg_data);
-						switch (msg_dataseg_flag)
-						{
-						case 0x0:
-							break;
-						}
-					}
-					*/
-				}
-			}
-
-			msg_escaped = purple_markup_escape_text(im_text.msg->str, im_text.msg->len);
-			if (fmt != NULL) {
-				msg_utf8 = qq_im_fmt_to_purple(fmt, g_string_new(msg_escaped));
-				qq_im_fmt_free(fmt);
-				g_free(msg_escaped);
-			} else {
-				msg_utf8 =  msg_escaped;
-			}
+			qq_im_seg_to_text(im_text.msg, data + bytes, len - bytes);
+			text = im_text.msg->str;
+			text_len = im_text.msg->len;
 			break;
 		}
 	case QQ_MSG_BUDDY_84:
@@ -940,19 +1012,9 @@ static void process_im_text(PurpleConnection *gc, guint8 *data, gint len, qq_im_
 
 			msg_smiley = qq_emoticon_to_purple(im_text.msg->str);
 			msg_utf8 = qq_to_utf8(msg_smiley, QQ_CHARSET_DEFAULT);
-			msg_escaped = purple_markup_escape_text(msg_utf8, -1);
-
-			if (fmt != NULL) {
-				msg_fmt = qq_im_fmt_to_purple(fmt, g_string_new(msg_escaped));
-				g_free(msg_escaped);
-				g_free(msg_utf8);
-				msg_utf8 =  msg_fmt;
-				qq_im_fmt_free(fmt);
-			} else {
-				g_free(msg_utf8);
-				msg_utf8 =  msg_escaped;
-			}
 			g_free(msg_smiley);
+			text = msg_utf8;
+			text_len = strlen(msg_utf8);
 
 			break;
 		}
@@ -962,15 +1024,26 @@ static void process_im_text(PurpleConnection *gc, guint8 *data, gint len, qq_im_
 
 	/* qq_show_packet("IM text", (guint8 *)im_text.msg , strlen(im_text.msg) ); */
 
-	/* send encoded to purple, note that we use im_text.send_time,
-	 * not the time we receive the message
-	 * as it may have been delayed when I am not online. */
-	purple_debug_info("QQ", "IM from %u: %s\n", im_header->uid_from,msg_utf8);
-	serv_got_im(gc, who, msg_utf8, purple_msg_flag, (time_t) im_text.send_time);
+	if (text != NULL) {
+		/* long message is delivered once all its fragments arrived */
+		memset(&frag, 0, sizeof(frag));
+		frag.is_room = FALSE;
+		frag.id = im_header->uid_from;
+		frag.msg_id = im_text.msg_id;
+		frag.count = im_text.fragment_count;
+		frag.index = im_text.fragment_index;
+		frag.send_time = im_text.send_time;
+		frag.purple_flag = purple_msg_flag;
+		qq_im_frag_add(gc, &frag, text, text_len, fmt);
+	} else if (fmt != NULL) {
+		qq_im_fmt_free(fmt);
+	}
 
 	g_free(msg_utf8);
 	g_free(who);
-	g_string_free (im_text.msg, TRUE);
+	if (im_text.msg != NULL) {
+		g_string_free(im_text.msg, TRUE);
+	}
 }
 
 void qq_process_typing( PurpleConnection *gc, guint8 *data, gint len, guint32 uid_from )
@@ -1058,10 +1131,14 @@ void qq_process_im( PurpleConnection *gc, guint8 *data, gint len, guint16 msg_ty
 }
 
 /* send an IM to uid_to */
-static void request_send_im(PurpleConnection *gc, guint32 uid_to, guint8 type, qq_im_format *fmt, const GString *msg, guint16 msg_id, time_t send_time, guint8 frag_count, guint8 frag_index)
+/* offsets of uid_to in qd->im_header */
+#define IM_HEADER_TO			4
+#define IM_HEADER_TO_AGAIN		31
+
+/* the leading part of send_im is the same for the whole session,
+ * build it once the session key is known */
+static void im_header_build(qq_data *qd)
 {
-	qq_data *qd;
-	guint8 raw_data[1024];
 	gint bytes;
 	static guint8 fill[] = {
 		0x00, 0x00, 0x00, 0x0D, 
@@ -1069,26 +1146,44 @@ static void request_send_im(PurpleConnection *gc, guint32 uid_to, guint8 type, q
 		0x00, 0x00, 0x00, 0x00, 
 		0x00, 0x03, 0x00, 0x01, 0x01
 	};
-	qd = (qq_data *) gc->proto_data;
 
-	/* purple_debug_info("QQ", "Send IM %d-%d\n", frag_count, frag_index); */
 	bytes = 0;
 	/* receiver uid */
-	bytes += qq_put32(raw_data + bytes, qd->uid);
-	/* sender uid */
-	bytes += qq_put32(raw_data + bytes, uid_to);
+	bytes += qq_put32(qd->im_header + bytes, qd->uid);
+	/* sender uid, patched per message */
+	bytes += qq_put32(qd->im_header + bytes, 0);
 	/* Unknown */
-	bytes += qq_putdata(raw_data + bytes, fill, sizeof(fill));
+	bytes += qq_putdata(qd->im_header + bytes, fill, sizeof(fill));
 	/* sender client version */
-	bytes += qq_put16(raw_data + bytes, qd->client_tag);
+	bytes += qq_put16(qd->im_header + bytes, qd->client_tag);
 	/* receiver uid */
-	bytes += qq_put32(raw_data + bytes, qd->uid);
-	/* sender uid */
-	bytes += qq_put32(raw_data + bytes, uid_to);
+	bytes += qq_put32(qd->im_header + bytes, qd->uid);
+	/* sender uid, patched per message */
+	bytes += qq_put32(qd->im_header + bytes, 0);
 	/* md5 of (uid+session_key) */
-	bytes += qq_putdata(raw_data + bytes, qd->session_md5, 16);
+	bytes += qq_putdata(qd->im_header + bytes, qd->session_md5, 16);
 	/* message type */
-	bytes += qq_put16(raw_data + bytes, QQ_NORMAL_IM_TEXT);
+	bytes += qq_put16(qd->im_header + bytes, QQ_NORMAL_IM_TEXT);
+
+	g_return_if_fail(bytes == QQ_IM_HEADER_LEN);
+	qd->is_im_header_ready = TRUE;
+}
+
+static void request_send_im(PurpleConnection *gc, guint32 uid_to, guint8 type, qq_im_format *fmt, const GString *msg, guint16 msg_id, time_t send_time, guint8 frag_count, guint8 frag_index)
+{
+	qq_data *qd;
+	guint8 raw_data[1024];
+	gint bytes;
+	qd = (qq_data *) gc->proto_data;
+
+	if (!qd->is_im_header_ready) {
+		im_header_build(qd);
+	}
+
+	/* purple_debug_info("QQ", "Send IM %d-%d\n", frag_count, frag_index); */
+	bytes = qq_putdata(raw_data, qd->im_header, QQ_IM_HEADER_LEN);
+	qq_put32(raw_data + IM_HEADER_TO, uid_to);
+	qq_put32(raw_data + IM_HEADER_TO_AGAIN, uid_to);
 	/* sequence number */
 	bytes += qq_put16(raw_data + bytes, qd->send_im_id);
 	/* send time */
@@ -1134,31 +1229,50 @@ static void request_send_im(PurpleConnection *gc, guint32 uid_to, guint8 type, q
 	qq_send_cmd(gc, QQ_CMD_SEND_IM, raw_data, bytes);
 }
 
-GSList *qq_im_get_segments(gchar *msg_stripped, gboolean is_smiley_none)
+/* bytes of the longest utf8 prefix of text within max, never cut a char in half */
+static gsize utf8_cut(const gchar *text, gsize len, gsize max)
+{
+	gsize cut;
+	gint i;
+
+	if (len <= max) {
+		return len;
+	}
+
+	/* text[cut] starts next part, back up if it is 10xxxxxx */
+	cut = max;
+	for (i = 0; i < 3 && cut > 0 && ((guint8) text[cut] & 0xC0) == 0x80; i++) {
+		cut--;
+	}
+	return cut;
+}
+
+/* grow segment buffer and return where the next segment is encoded */
+static guint8 *segment_reserve(GString *string_seg, gint len)
+{
+	gsize pos = string_seg->len;
+
+	g_string_set_size(string_seg, pos + len);
+	return (guint8 *) string_seg->str + pos;
+}
+
+GSList *qq_im_get_segments(PurpleConnection *gc, gchar *msg_stripped, gboolean is_smiley_none)
 {
 	GSList *string_list = NULL;
 	GString *string_seg;
-	gchar *start0=NULL, *p0=NULL, *start1=NULL, *p1=NULL, *end1=NULL, *tmp;
+	gchar *start0=NULL, *p0=NULL, *start1=NULL, *end1=NULL, *tmp;
 	guint msg_len;
 	guint16 string_len=0;
-	guint16 string_ad_len;
-	qq_emoticon *emoticon;
-	qq_image *image;
-	static gchar em_prefix[] = {
-		0x00, 0x09, 0x01, 0x00, 0x01
-	};
-	static gchar em_suffix[] = {
-		0xFF, 0x00, 0x02, 0x14
-	};
-	static gchar image_fill[] = {
-		0x14, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00 
-	};
+	gint image_len;
+	qq_emoticon *emoticon = NULL;
+	const gchar *image = NULL;
 
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, NULL);
 	g_return_val_if_fail(msg_stripped != NULL, NULL);
 
 	//start0 = msg_stripped;
 	msg_len = strlen(msg_stripped);
-	string_seg = g_string_new("");
+	string_seg = g_string_sized_new(QQ_MSG_IM_MAX);
 
 	p0 = msg_stripped;
 	start0 = p0;
@@ -1172,7 +1286,9 @@ GSList *qq_im_get_segments(gchar *msg_stripped, gboolean is_smiley_none)
 			end1 = msg_stripped + msg_len;
 		}
 		else {
-			if ((image = image_find(p0)) || (emoticon = emoticon_find(p0)))		//find out if it is a emoticon or image
+			emoticon = NULL;
+			if ((image = image_find((qq_data *) gc->proto_data, p0))
+					|| (!is_smiley_none && (emoticon = emoticon_match(p0))))		//find out if it is a emoticon or image
 			{
 				/* if found, append proper bytes of text before '/'  */
 				start1 = start0;
@@ -1183,71 +1299,37 @@ GSList *qq_im_get_segments(gchar *msg_stripped, gboolean is_smiley_none)
 			}
 		}
 
-		p1 = start1;
-		while (p1 < end1)
+		/* fill up current fragment with text, then go on with a new one */
+		while (start1 < end1)
 		{
-			if (end1 - p1 + 6 > QQ_MSG_IM_MAX)
-			{
-				/* get n utf8 chars with certain size */
-				start1 = p1;
-				while (p1 < start1 + QQ_MSG_IM_MAX - 6)
-					p1 = g_utf8_next_char(p1);
-				p1 = g_utf8_prev_char (p1);
-
-				string_len = p1 - start1;
-			} else {
-				start1 = p1;
-				p1 = end1;
-				string_len = p1 - start1;
+			string_len = 0;
+			if (string_seg->len + QQ_IM_SEG_TEXT_WRAP < QQ_MSG_IM_MAX) {
+				string_len = utf8_cut(start1, end1 - start1,
+						QQ_MSG_IM_MAX - QQ_IM_SEG_TEXT_WRAP - string_seg->len);
 			}
-
-			if (string_len >0)
+			if (string_len == 0)
 			{
-				if (string_seg->len + string_len + 6 > QQ_MSG_IM_MAX)		//6 is wrapper size of text
-				{
-					/* enough chars to send */
-					string_list = g_slist_append(string_list, string_seg);
-					string_seg = g_string_new("");
-				}
-				g_string_append_c(string_seg, 0x01);		//TEXT FLAG
-				string_ad_len = string_len + 3;		//len of text plus prepended data
-				string_ad_len = htons(string_ad_len);
-				g_string_append_len(string_seg, (gchar *)&string_ad_len, sizeof(guint16));
-				g_string_append_c(string_seg, 0x01);		//Unknown FLAG
-				string_ad_len = htons(string_len);
-				g_string_append_len(string_seg, (gchar *)&string_ad_len, sizeof(guint16));
-				g_string_append_len(string_seg, start1, string_len);
+				/* enough chars to send */
+				string_list = g_slist_append(string_list, string_seg);
+				string_seg = g_string_sized_new(QQ_MSG_IM_MAX);
+				continue;
 			}
+			qq_im_seg_put_text(segment_reserve(string_seg, string_len + QQ_IM_SEG_TEXT_WRAP),
+					start1, string_len);
+			start1 += string_len;
 		}
 		
 		if (p0 && image)
 		{
-			if (string_seg->len  + 20 + 2*strlen(image->filename) > QQ_MSG_IM_MAX)
+			image_len = QQ_IM_SEG_IMAGE_WRAP + 2 * strlen(image);
+			if (string_seg->len + image_len > QQ_MSG_IM_MAX)
 			{
 				/* enough chars to send */
 				string_list = g_slist_append(string_list, string_seg);
-				string_seg = g_string_new("");
+				string_seg = g_string_sized_new(QQ_MSG_IM_MAX);
 			}
-
-			g_string_append_c(string_seg, 0x03);		//IMAGE FLAG
-			string_ad_len = 17 + 2*strlen(image->filename);		//len of text plus prepended data
-			string_ad_len = htons(string_ad_len);
-			g_string_append_len(string_seg, (gchar *)&string_ad_len, sizeof(guint16));
-
-			g_string_append_c(string_seg, 0x02);		//Unknown FLAG
-			string_ad_len = htons(strlen(image->filename));
-			g_string_append_len(string_seg, (gchar *)&string_ad_len, sizeof(guint16));
-			g_string_append_len(string_seg, image->filename, strlen(image->filename));
-			g_string_append_len(string_seg, image_fill, sizeof(image_fill));	//Fixed Fill
-
-			g_string_append_c(string_seg, 0xFF);		//Unknown FLAG
-			string_ad_len = htons(strlen(image->filename) + 4);
-			g_string_append_len(string_seg, (gchar *)&string_ad_len, sizeof(guint16));
-			g_string_append_c(string_seg, 0x15);
-			g_string_append_c(string_seg, 0x33);
-			g_string_append_c(string_seg, 0x32);
-			g_string_append_len(string_seg, image->filename, strlen(image->filename));
-			g_string_append_c(string_seg, 0x41);
+			qq_im_seg_put_image(segment_reserve(string_seg, image_len), image);
+			image = NULL;
 
 			p0 = g_utf8_strchr(p0, 14, '$');
 			p0 ++;
@@ -1259,11 +1341,11 @@ GSList *qq_im_get_segments(gchar *msg_stripped, gboolean is_smiley_none)
 		/* if '/' is found, first check if it is emoticon, if so, append it */
 		if ( !is_smiley_none && p0 )
 		{
-			if (string_seg->len  + 12 > QQ_MSG_IM_MAX)		//12 is size of a emoticon
+			if (string_seg->len + QQ_IM_SEG_EMOTICON_LEN > QQ_MSG_IM_MAX)
 			{
 				/* enough chars to send */
 				string_list = g_slist_append(string_list, string_seg);
-				string_seg = g_string_new("");
+				string_seg = g_string_sized_new(QQ_MSG_IM_MAX);
 			}
 
 			if (emoticon != NULL) {
@@ -1272,11 +1354,8 @@ GSList *qq_im_get_segments(gchar *msg_stripped, gboolean is_smiley_none)
 				/* Until Now, We haven't the new emoticon key database */
 				/* So Just Send a Settled V Gesture */
 				//g_string_append_len(string_seg, em_v, sizeof(em_v));
-				g_string_append_c(string_seg, 0x02);		//EMOTICON FLAG
-				g_string_append_len(string_seg, em_prefix, sizeof(em_prefix));
-				g_string_append_c(string_seg, emoticon->index);
-				g_string_append_len(string_seg, em_suffix, sizeof(em_suffix));
-				g_string_append_c(string_seg, emoticon->symbol);
+				qq_im_seg_put_emoticon(segment_reserve(string_seg, QQ_IM_SEG_EMOTICON_LEN),
+						emoticon->index, emoticon->symbol);
 				p0 += strlen(emoticon->name);
 				start0 = p0;
 			} else {
@@ -1463,7 +1542,7 @@ gint qq_send_im(PurpleConnection *gc, const gchar *who, const gchar *what, Purpl
 	}
 
 	is_smiley_none = qq_im_smiley_none(what);
-	segments = qq_im_get_segments(msg_stripped, is_smiley_none);
+	segments = qq_im_get_segments(gc, msg_stripped, is_smiley_none);
 	g_free(msg_stripped);
 
 	if (segments == NULL) {
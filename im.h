@@ -71,9 +71,9 @@ gint qq_get_im_tail(qq_im_format *fmt, guint8 *data, gint data_len);
 qq_im_format *qq_im_fmt_new_default(void);
 void qq_im_fmt_free(qq_im_format *fmt);
 qq_im_format *qq_im_fmt_new_by_purple(const gchar *msg);
-gchar *qq_im_fmt_to_purple(qq_im_format *fmt, GString *text);
+gchar *qq_im_fmt_to_purple(qq_im_format *fmt, const gchar *text, gssize len);
 gboolean qq_im_smiley_none(const gchar *msg);
-GSList *qq_im_get_segments(gchar *msg_stripped, gboolean is_smiley_none);
+GSList *qq_im_get_segments(PurpleConnection *gc, gchar *msg_stripped, gboolean is_smiley_none);
 
 void qq_got_message(PurpleConnection *gc, const gchar *msg);
 gint qq_send_im(PurpleConnection *gc, const gchar *who, const gchar *message, PurpleMessageFlags flags);
@@ -81,7 +81,7 @@ void qq_process_typing( PurpleConnection *gc, guint8 *data, gint len, guint32 ui
 void qq_process_im(PurpleConnection *gc, guint8 *data, gint len, guint16 msg_type);
 void qq_process_extend_im(PurpleConnection *gc, guint8 *data, gint len);
 
-gchar *qq_emoticon_to_purple(gchar *text);
+gchar *qq_emoticon_to_purple(const gchar *text);
 gchar *emoticon_get(guint8 symbol);
 unsigned int qq_send_typing(PurpleConnection *gc, const char *who, PurpleTypingState state);
 
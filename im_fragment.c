@@ -0,0 +1,284 @@
+/**
+ * @file im_fragment.c
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "internal.h"
+
+#include "debug.h"
+#include "server.h"
+
+#include "qq.h"
+#include "group_im.h"
+#include "im_fragment.h"
+#include "utils.h"
+
+#define QQ_IM_FRAG_TIMEOUT		30				/* seconds to wait for the rest */
+#define QQ_IM_FRAG_CHECK		5
+#define QQ_IM_FRAG_MAX			64				/* messages pending at most */
+#define QQ_IM_FRAG_BUDGET		(256 * 1024)	/* bytes of text pending at most */
+
+typedef struct _qq_im_frag {
+	qq_im_frag_info info;	/* index is not used */
+	qq_im_format *fmt;
+	GString **parts;		/* info.count of them, NULL if not arrived */
+	guint8 got;
+	gsize bytes;
+	time_t expire;
+	GList *link;			/* in qq_im_frags.order */
+} qq_im_frag;
+
+struct _qq_im_frags {
+	GHashTable *table;		/* by sender and msg_id */
+	GQueue *order;			/* oldest first */
+	gsize bytes;
+	guint timer;
+};
+
+static guint frag_hash(gconstpointer key)
+{
+	const qq_im_frag_info *info = (const qq_im_frag_info *) key;
+
+	return (info->id * 31 + info->from) * 31 + info->msg_id;
+}
+
+static gboolean frag_equal(gconstpointer a, gconstpointer b)
+{
+	const qq_im_frag_info *x = (const qq_im_frag_info *) a;
+	const qq_im_frag_info *y = (const qq_im_frag_info *) b;
+
+	return x->msg_id == y->msg_id && x->id == y->id && x->from == y->from
+		&& x->is_room == y->is_room;
+}
+
+static void frag_free(qq_im_frag *frag)
+{
+	gint i;
+
+	for (i = 0; i < frag->info.count; i++) {
+		if (frag->parts[i] != NULL) {
+			g_string_free(frag->parts[i], TRUE);
+		}
+	}
+	g_free(frag->parts);
+	if (frag->fmt != NULL) {
+		qq_im_fmt_free(frag->fmt);
+	}
+	g_free(frag);
+}
+
+/* format the whole message and give it to purple */
+static void frag_deliver(PurpleConnection *gc, const qq_im_frag_info *info,
+		const gchar *text, gsize len, qq_im_format *fmt)
+{
+	gchar *msg, *who;
+
+	msg = qq_im_fmt_to_purple(fmt, text, len);
+	if (info->is_room) {
+		purple_debug_info("QQ", "Room (%u) IM from %u: %s\n", info->id, info->from, msg);
+		qq_room_got_chat_in(gc, info->id, info->from, msg, info->send_time);
+	} else {
+		/* note that we use send_time, not the time we receive the message
+		 * as it may have been delayed when I am not online. */
+		purple_debug_info("QQ", "IM from %u: %s\n", info->id, msg);
+		who = uid_to_purple_name(info->id);
+		serv_got_im(gc, who, msg, info->purple_flag, info->send_time);
+		g_free(who);
+	}
+	g_free(msg);
+}
+
+/* take frag out of table, deliver what has arrived and free it */
+static void frag_finish(PurpleConnection *gc, qq_im_frags *frags, qq_im_frag *frag)
+{
+	GString *text;
+	gint i;
+
+	g_hash_table_remove(frags->table, &frag->info);
+	g_queue_delete_link(frags->order, frag->link);
+	frags->bytes -= frag->bytes;
+
+	if (frag->got < frag->info.count) {
+		purple_debug_warning("QQ", "IM %u from %u, only %d of %d fragments arrived\n",
+				frag->info.msg_id, frag->info.is_room ? frag->info.from : frag->info.id,
+				frag->got, frag->info.count);
+	}
+
+	text = g_string_sized_new(frag->bytes);
+	for (i = 0; i < frag->info.count; i++) {
+		if (frag->parts[i] != NULL) {
+			g_string_append_len(text, frag->parts[i]->str, frag->parts[i]->len);
+		}
+	}
+	frag_deliver(gc, &frag->info, text->str, text->len, frag->fmt);
+	g_string_free(text, TRUE);
+	frag_free(frag);
+}
+
+static gboolean frags_timeout(gpointer data)
+{
+	PurpleConnection *gc = (PurpleConnection *) data;
+	qq_data *qd;
+	qq_im_frags *frags;
+	qq_im_frag *frag;
+	time_t now;
+
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, FALSE);
+	qd = (qq_data *) gc->proto_data;
+	frags = qd->im_frags;
+	g_return_val_if_fail(frags != NULL, FALSE);
+
+	now = time(NULL);
+	while ((frag = g_queue_peek_head(frags->order)) != NULL && frag->expire <= now) {
+		frag_finish(gc, frags, frag);
+	}
+	if (g_queue_is_empty(frags->order)) {
+		frags->timer = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static qq_im_frags *frags_get(qq_data *qd)
+{
+	if (qd->im_frags == NULL) {
+		qd->im_frags = g_new0(qq_im_frags, 1);
+		qd->im_frags->table = g_hash_table_new(frag_hash, frag_equal);
+		qd->im_frags->order = g_queue_new();
+	}
+	return qd->im_frags;
+}
+
+void qq_im_frag_add(PurpleConnection *gc, const qq_im_frag_info *info,
+		const gchar *text, gsize len, qq_im_format *fmt)
+{
+	qq_data *qd;
+	qq_im_frags *frags;
+	qq_im_frag *frag;
+	qq_im_frag *oldest;
+
+	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
+	g_return_if_fail(info != NULL && text != NULL);
+	qd = (qq_data *) gc->proto_data;
+
+	if (info->count <= 1 || info->index >= info->count) {
+		frag_deliver(gc, info, text, len, fmt);
+		if (fmt != NULL) {
+			qq_im_fmt_free(fmt);
+		}
+		return;
+	}
+
+	frags = frags_get(qd);
+	frag = g_hash_table_lookup(frags->table, info);
+	if (frag != NULL && frag->info.count != info->count) {
+		/* msg_id is reused by another message */
+		frag_finish(gc, frags, frag);
+		frag = NULL;
+	}
+
+	if (frag == NULL) {
+		/* make room, the oldest goes first */
+		while (g_queue_get_length(frags->order) >= QQ_IM_FRAG_MAX) {
+			frag_finish(gc, frags, g_queue_peek_head(frags->order));
+		}
+
+		frag = g_new0(qq_im_frag, 1);
+		frag->info = *info;
+		frag->parts = g_new0(GString *, info->count);
+		frag->expire = time(NULL) + QQ_IM_FRAG_TIMEOUT;
+		g_queue_push_tail(frags->order, frag);
+		frag->link = g_queue_peek_tail_link(frags->order);
+		g_hash_table_insert(frags->table, &frag->info, frag);
+	}
+
+	if (frag->parts[info->index] != NULL) {
+		purple_debug_info("QQ", "Duplicated fragment %d of IM %u\n", info->index, info->msg_id);
+		if (fmt != NULL) {
+			qq_im_fmt_free(fmt);
+		}
+		return;
+	}
+
+	/* stay in budget for every fragment, keep the one being filled */
+	while (frags->bytes + len > QQ_IM_FRAG_BUDGET) {
+		oldest = g_queue_peek_head(frags->order);
+		if (oldest == frag) {
+			oldest = g_queue_peek_nth(frags->order, 1);
+		}
+		if (oldest == NULL) {
+			break;
+		}
+		frag_finish(gc, frags, oldest);
+	}
+
+	frag->parts[info->index] = g_string_new_len(text, len);
+	frag->got++;
+	frag->bytes += len;
+	frags->bytes += len;
+	if (info->send_time < frag->info.send_time) {
+		frag->info.send_time = info->send_time;
+	}
+
+	/* font attributes come with the last fragment */
+	if (fmt != NULL) {
+		if (frag->fmt == NULL || info->index == info->count - 1) {
+			if (frag->fmt != NULL) {
+				qq_im_fmt_free(frag->fmt);
+			}
+			frag->fmt = fmt;
+		} else {
+			qq_im_fmt_free(fmt);
+		}
+	}
+
+	if (frag->got == frag->info.count) {
+		frag_finish(gc, frags, frag);
+	} else if (frags->timer == 0) {
+		frags->timer = purple_timeout_add_seconds(QQ_IM_FRAG_CHECK, frags_timeout, gc);
+	}
+}
+
+void qq_im_frag_remove_all(PurpleConnection *gc)
+{
+	qq_data *qd;
+	qq_im_frags *frags;
+	qq_im_frag *frag;
+
+	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *) gc->proto_data;
+	frags = qd->im_frags;
+	if (frags == NULL) {
+		return;
+	}
+
+	if (frags->timer > 0) {
+		purple_timeout_remove(frags->timer);
+	}
+	while ((frag = g_queue_pop_head(frags->order)) != NULL) {
+		frag_free(frag);
+	}
+	g_queue_free(frags->order);
+	g_hash_table_destroy(frags->table);
+	g_free(frags);
+	qd->im_frags = NULL;
+}
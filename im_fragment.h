@@ -0,0 +1,54 @@
+/**
+ * @file im_fragment.h
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _QQ_IM_FRAGMENT_H_
+#define _QQ_IM_FRAGMENT_H_
+
+#include <glib.h>
+#include "connection.h"
+
+#include "im.h"
+
+/* where a fragment comes from and how its message is given to purple */
+typedef struct _qq_im_frag_info {
+	gboolean is_room;
+	guint32 id;				/* buddy uid, or room id */
+	guint32 from;			/* member uid, room only */
+	guint16 msg_id;
+	guint8 count;
+	guint8 index;
+	time_t send_time;
+	guint16 purple_flag;	/* buddy only */
+} qq_im_frag_info;
+
+/* text is plain UTF-8, fmt may be NULL and is owned by the table from now.
+ * the whole message is formatted and delivered once all fragments arrived,
+ * or when it timed out or was evicted. a single fragment is delivered now. */
+void qq_im_frag_add(PurpleConnection *gc, const qq_im_frag_info *info,
+		const gchar *text, gsize len, qq_im_format *fmt);
+
+/* drop all pending fragments, called when disconnected */
+void qq_im_frag_remove_all(PurpleConnection *gc);
+
+#endif
@@ -0,0 +1,180 @@
+/**
+ * @file im_segment.c
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "internal.h"
+
+#include "debug.h"
+
+#include "im.h"
+#include "im_segment.h"
+#include "packet_parse.h"
+
+/* emoticon: 01 00 01(sizeof INDEX) INDEX(new) FF 00 02(sizeof SYM) 14 SYM(old) */
+static const guint8 em_prefix[] = { 0x01, 0x00, 0x01 };
+static const guint8 em_suffix[] = { 0xFF, 0x00, 0x02, 0x14 };
+#define EM_SYMBOL_POS	8
+
+static const guint8 image_fill[] = {
+	0x14, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00
+};
+
+void qq_im_seg_reader_init(qq_im_seg_reader *reader, const guint8 *data, gint len)
+{
+	reader->data = data;
+	reader->len = (data != NULL && len > 0) ? len : 0;
+	reader->pos = 0;
+}
+
+gboolean qq_im_seg_next(qq_im_seg_reader *reader, qq_im_seg *seg)
+{
+	const guint8 *p;
+	gint seg_len, text_len;
+
+	g_return_val_if_fail(reader != NULL && seg != NULL, FALSE);
+
+	/* type and length */
+	if (reader->len - reader->pos < 3) {
+		return FALSE;
+	}
+	p = reader->data + reader->pos;
+	seg_len = (p[1] << 8) | p[2];
+	if (seg_len > reader->len - reader->pos - 3) {
+		purple_debug_warning("QQ", "IM segment 0x%02X of %d bytes, only %d left\n",
+				p[0], seg_len, reader->len - reader->pos - 3);
+		return FALSE;
+	}
+	reader->pos += 3 + seg_len;
+
+	seg->type = p[0];
+	seg->data = p + 3;
+	seg->len = seg_len;
+	seg->symbol = 0;
+
+	switch (seg->type) {
+		case QQ_IM_SEG_TEXT:
+			/* 01 LEN TEXT */
+			if (seg_len < 3) {
+				seg->len = 0;
+				break;
+			}
+			text_len = (seg->data[1] << 8) | seg->data[2];
+			seg->data += 3;
+			seg->len = MIN(text_len, seg_len - 3);
+			break;
+		case QQ_IM_SEG_EMOTICON:
+			if (seg_len > EM_SYMBOL_POS) {
+				seg->symbol = seg->data[EM_SYMBOL_POS];
+			}
+			break;
+		default:
+			break;
+	}
+	return TRUE;
+}
+
+void qq_im_seg_to_text(GString *str, const guint8 *data, gint len)
+{
+	qq_im_seg_reader reader;
+	qq_im_seg seg;
+	const gchar *purple_smiley;
+
+	g_return_if_fail(str != NULL);
+
+	qq_im_seg_reader_init(&reader, data, len);
+	while (qq_im_seg_next(&reader, &seg)) {
+		switch (seg.type) {
+			case QQ_IM_SEG_TEXT:
+				g_string_append_len(str, (const gchar *) seg.data, seg.len);
+				break;
+			case QQ_IM_SEG_EMOTICON:
+				purple_smiley = emoticon_get(seg.symbol);
+				if (purple_smiley == NULL) {
+					purple_debug_info("QQ", "Not found smiley of 0x%02X\n", seg.symbol);
+					g_string_append(str, "/v$");
+				} else {
+					g_string_append(str, purple_smiley);
+				}
+				break;
+			case QQ_IM_SEG_IMAGE:
+				/* TODO: custom image is not supported yet */
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+gint qq_im_seg_put_text(guint8 *buf, const gchar *text, gint text_len)
+{
+	gint bytes = 0;
+
+	g_return_val_if_fail(buf != NULL && text != NULL && text_len >= 0, 0);
+
+	bytes += qq_put8(buf + bytes, QQ_IM_SEG_TEXT);
+	bytes += qq_put16(buf + bytes, text_len + 3);
+	bytes += qq_put8(buf + bytes, 0x01);		/* Unknown FLAG */
+	bytes += qq_put16(buf + bytes, text_len);
+	bytes += qq_putdata(buf + bytes, (guint8 *) text, text_len);
+	return bytes;
+}
+
+gint qq_im_seg_put_emoticon(guint8 *buf, guint8 index, guint8 symbol)
+{
+	gint bytes = 0;
+
+	g_return_val_if_fail(buf != NULL, 0);
+
+	bytes += qq_put8(buf + bytes, QQ_IM_SEG_EMOTICON);
+	bytes += qq_put16(buf + bytes, sizeof(em_prefix) + 1 + sizeof(em_suffix) + 1);
+	bytes += qq_putdata(buf + bytes, em_prefix, sizeof(em_prefix));
+	bytes += qq_put8(buf + bytes, index);
+	bytes += qq_putdata(buf + bytes, em_suffix, sizeof(em_suffix));
+	bytes += qq_put8(buf + bytes, symbol);
+	return bytes;
+}
+
+gint qq_im_seg_put_image(guint8 *buf, const gchar *filename)
+{
+	gint bytes = 0;
+	gint len;
+
+	g_return_val_if_fail(buf != NULL && filename != NULL, 0);
+	len = strlen(filename);
+
+	bytes += qq_put8(buf + bytes, QQ_IM_SEG_IMAGE);
+	bytes += qq_put16(buf + bytes, 17 + 2 * len);
+	bytes += qq_put8(buf + bytes, 0x02);		/* Unknown FLAG */
+	bytes += qq_put16(buf + bytes, len);
+	bytes += qq_putdata(buf + bytes, (guint8 *) filename, len);
+	bytes += qq_putdata(buf + bytes, image_fill, sizeof(image_fill));	/* Fixed Fill */
+
+	bytes += qq_put8(buf + bytes, 0xFF);		/* Unknown FLAG */
+	bytes += qq_put16(buf + bytes, len + 4);
+	bytes += qq_put8(buf + bytes, 0x15);
+	bytes += qq_put8(buf + bytes, 0x33);
+	bytes += qq_put8(buf + bytes, 0x32);
+	bytes += qq_putdata(buf + bytes, (guint8 *) filename, len);
+	bytes += qq_put8(buf + bytes, 0x41);
+	return bytes;
+}
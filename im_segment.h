@@ -0,0 +1,66 @@
+/**
+ * @file im_segment.h
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _QQ_IM_SEGMENT_H_
+#define _QQ_IM_SEGMENT_H_
+
+#include <glib.h>
+
+/* segments of rich message body, used by buddy and room IM */
+enum {
+	QQ_IM_SEG_TEXT = 0x01,
+	QQ_IM_SEG_EMOTICON = 0x02,
+	QQ_IM_SEG_IMAGE = 0x03
+};
+
+#define QQ_IM_SEG_TEXT_WRAP			6		/* bytes around text */
+#define QQ_IM_SEG_EMOTICON_LEN		12
+#define QQ_IM_SEG_IMAGE_WRAP		20		/* bytes around twice of filename */
+
+typedef struct _qq_im_seg {
+	guint8 type;
+	const guint8 *data;		/* point into the packet, not 0x00 ended */
+	gint len;
+	guint8 symbol;			/* old emoticon symbol, emoticon only */
+} qq_im_seg;
+
+typedef struct _qq_im_seg_reader {
+	const guint8 *data;
+	gint len;
+	gint pos;
+} qq_im_seg_reader;
+
+void qq_im_seg_reader_init(qq_im_seg_reader *reader, const guint8 *data, gint len);
+/* return FALSE at the end or if the rest is broken */
+gboolean qq_im_seg_next(qq_im_seg_reader *reader, qq_im_seg *seg);
+
+/* append text and purple smileys of all segments */
+void qq_im_seg_to_text(GString *str, const guint8 *data, gint len);
+
+/* write one segment into buf, which must have room for it, return bytes written */
+gint qq_im_seg_put_text(guint8 *buf, const gchar *text, gint text_len);
+gint qq_im_seg_put_emoticon(guint8 *buf, guint8 index, guint8 symbol);
+gint qq_im_seg_put_image(guint8 *buf, const gchar *filename);
+
+#endif
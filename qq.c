@@ -53,6 +53,8 @@
 #include "packet_parse.h"
 #include "qq.h"
 #include "qq_network.h"
+#include "qq_stat.h"
+#include "qq_trans.h"
 #include "send_file.h"
 #include "utils.h"
 #include "version.h"
@@ -96,6 +98,7 @@ static void server_list_create(PurpleAccount *account)
 	PurpleConnection *gc;
 	qq_data *qd;
 	const gchar *custom_server;
+	const gchar *last_redirect;
 
 	gc = purple_account_get_connection(account);
 	g_return_if_fail(gc != NULL  && gc->proto_data != NULL);
@@ -115,10 +118,16 @@ static void server_list_create(PurpleAccount *account)
 
 	if (qd->use_tcp) {
 		qd->servers =	server_list_build('T');
-		return;
+	} else {
+		qd->servers =	server_list_build('U');
 	}
 
-	qd->servers =	server_list_build('U');
+	/* the server we were redirected to last time is likely to accept us */
+	last_redirect = qq_server_board_last_redirect(qd->server_board);
+	if (last_redirect != NULL
+			&& g_list_find_custom(qd->servers, last_redirect, (GCompareFunc) strcmp) == NULL) {
+		qd->servers = g_list_prepend(qd->servers, (gchar *) last_redirect);
+	}
 }
 
 static void server_list_remove_all(qq_data *qd)
@@ -147,6 +156,7 @@ static void qq_login(PurpleAccount *account)
 	qd = g_new0(qq_data, 1);
 	memset(qd, 0, sizeof(qq_data));
 	qd->gc = gc;
+	qd->str_pool = qq_str_pool_new();
 	gc->proto_data = qd;
 
 	presence = purple_account_get_presence(account);
@@ -159,6 +169,7 @@ static void qq_login(PurpleAccount *account)
 		qd->login_mode = QQ_LOGIN_MODE_NORMAL;
 	}
 
+	qd->server_board = qq_server_board_load(account);
 	server_list_create(account);
 	purple_debug_info("QQ", "Server list has %d\n", g_list_length(qd->servers));
 
@@ -193,6 +204,9 @@ static void qq_login(PurpleAccount *account)
 	purple_debug_info("QQ", "Resend interval %d, retries %d\n",
 			qd->itv_config.resend, qd->resend_times);
 
+	qd->worker_threads = purple_prefs_get_int("/plugins/prpl/qq/worker_threads");
+	if (qd->worker_threads < 0) qd->worker_threads = 0;
+
 	qd->itv_config.keep_alive = purple_account_get_int(account, "keep_alive_interval", 60);
 	if (qd->itv_config.keep_alive < 30) qd->itv_config.keep_alive = 40;
 	qd->itv_config.keep_alive /= qd->itv_config.resend;
@@ -208,6 +222,7 @@ static void qq_login(PurpleAccount *account)
 	} else {
 		qd->itv_config.update = 0;
 	}
+	qd->itv_effect = qd->itv_config;
 
 	qd->connect_watcher = purple_timeout_add_seconds(0, qq_connect_later, gc);
 }
@@ -254,6 +269,13 @@ static void qq_close(PurpleConnection *gc)
 	if (qd->ld.token_verify_de) g_free(qd->ld.token_verify_de);
 	
 	server_list_remove_all(qd);
+	qq_server_board_free(qd->server_board);
+	qq_trans_pool_free(gc);
+	qq_net_stat_free(qd);
+	qq_str_pool_free(qd->str_pool);
+	if (qd->image_names != NULL) {
+		g_hash_table_destroy(qd->image_names);
+	}
 
 	g_free(qd);
 	gc->proto_data = NULL;
@@ -598,6 +620,7 @@ static void action_show_account_info(PurplePluginAction *action)
 	GString *info;
 	struct tm *tm_local;
 	int index;
+	qq_trans_pool_stat pool_stat;
 
 	g_return_if_fail(NULL != gc && NULL != gc->proto_data);
 	qd = (qq_data *) gc->proto_data;
@@ -607,6 +630,7 @@ static void action_show_account_info(PurplePluginAction *action)
 	g_string_append_printf(info, _("<b>Login time</b>: %d-%d-%d, %d:%d:%d<br>\n"),
 			(1900 +tm_local->tm_year), (1 + tm_local->tm_mon), tm_local->tm_mday,
 			tm_local->tm_hour, tm_local->tm_min, tm_local->tm_sec);
+	g_string_append_printf(info, _("<b>Login Cost</b>: %ld ms<br>\n"), qd->ld.login_ms);
 	g_string_append_printf(info, _("<b>Total Online Buddies</b>: %d<br>\n"), qd->online_total);
 	tm_local = localtime(&qd->online_last_update);
 	g_string_append_printf(info, _("<b>Last Refresh</b>: %d-%d-%d, %d:%d:%d<br>\n"),
@@ -627,6 +651,18 @@ static void action_show_account_info(PurplePluginAction *action)
 	g_string_append_printf(info, _("<b>Lost</b>: %lu<br>\n"), qd->net_stat.lost);
 	g_string_append_printf(info, _("<b>Received</b>: %lu<br>\n"), qd->net_stat.rcved);
 	g_string_append_printf(info, _("<b>Received Duplicate</b>: %lu<br>\n"), qd->net_stat.rcved_dup);
+	g_string_append_printf(info, _("<b>Keep Alive</b>: every %d seconds, %lu skipped<br>\n"),
+			qd->itv_effect.keep_alive * qd->itv_config.resend, qd->net_stat.keep_alive_skipped);
+	if (qd->itv_effect.update > 0) {
+		g_string_append_printf(info, _("<b>Update Online</b>: every %d seconds<br>\n"),
+				qd->itv_effect.update * qd->itv_config.resend);
+	}
+
+	qq_trans_get_pool_stat(gc, &pool_stat);
+	g_string_append_printf(info, _("<b>Transactions</b>: %d used, %d cached in %d slabs<br>\n"),
+			pool_stat.trans_used, pool_stat.trans_cached, pool_stat.slabs);
+	g_string_append_printf(info, _("<b>Payloads</b>: %d used, %d cached, %lu bytes<br>\n"),
+			pool_stat.buf_used, pool_stat.buf_cached, (gulong) pool_stat.buf_bytes);
 
 	g_string_append(info, "<hr>");
 	g_string_append(info, "<i>Last Login Information</i><br>\n");
@@ -648,6 +684,43 @@ static void action_show_account_info(PurplePluginAction *action)
 	g_string_free(info, TRUE);
 }
 
+static void action_show_cmd_stat(PurplePluginAction *action)
+{
+	PurpleConnection *gc = (PurpleConnection *) action->context;
+	gchar *html;
+
+	g_return_if_fail(NULL != gc && NULL != gc->proto_data);
+
+	html = qq_net_stat_to_html((qq_data *) gc->proto_data);
+	purple_notify_formatted(gc, NULL, _("Command Statistics"), NULL, html, NULL, NULL);
+	g_free(html);
+}
+
+/* write statistics as JSON into user dir */
+static void action_save_cmd_stat(PurplePluginAction *action)
+{
+	PurpleConnection *gc = (PurpleConnection *) action->context;
+	qq_data *qd;
+	gchar *json;
+	gchar *filename;
+	gchar *path;
+
+	g_return_if_fail(NULL != gc && NULL != gc->proto_data);
+	qd = (qq_data *) gc->proto_data;
+
+	json = qq_net_stat_to_json(qd);
+	filename = g_strdup_printf("qq_stat_%u.json", qd->uid);
+	path = g_build_filename(purple_user_dir(), filename, NULL);
+	if (purple_util_write_data_to_file(filename, json, -1)) {
+		purple_notify_info(gc, _("Command Statistics"), _("Statistics saved"), path);
+	} else {
+		purple_notify_error(gc, _("Command Statistics"), _("Failed to save statistics"), path);
+	}
+	g_free(path);
+	g_free(filename);
+	g_free(json);
+}
+
 static void action_about_libqq(PurplePluginAction *action)
 {
 	PurpleConnection *gc = (PurpleConnection *) action->context;
@@ -882,6 +955,12 @@ static GList *qq_actions(PurplePlugin *plugin, gpointer context)
 	act = purple_plugin_action_new(_("Update all QQ Quns"), action_update_all_rooms);
 	m = g_list_append(m, act);
 	*/
+	act = purple_plugin_action_new(_("Command Statistics"), action_show_cmd_stat);
+	m = g_list_append(m, act);
+
+	act = purple_plugin_action_new(_("Save Command Statistics"), action_save_cmd_stat);
+	m = g_list_append(m, act);
+
 	act = purple_plugin_action_new(_("About LibQQ"), action_about_libqq);
 	m = g_list_append(m, act);
 	/*
@@ -1135,6 +1214,12 @@ static PurplePluginProtocolInfo prpl_info =
 	NULL							/* get_public_alias */
 };
 
+static gboolean plugin_unload(PurplePlugin *plugin)
+{
+	qq_conv_cache_free();
+	return TRUE;
+}
+
 static PurplePluginInfo info = {
 	PURPLE_PLUGIN_MAGIC,
 	PURPLE_MAJOR_VERSION,
@@ -1156,7 +1241,7 @@ static PurplePluginInfo info = {
 	PURPLE_WEBSITE,		/**< homepage	*/
 
 	NULL,				/**< load		*/
-	NULL,				/**< unload		*/
+	plugin_unload,		/**< unload		*/
 	NULL,				/**< destroy		*/
 
 	NULL,				/**< ui_info		*/
@@ -1251,6 +1336,7 @@ static void init_plugin(PurplePlugin *plugin)
 	purple_prefs_add_bool("/plugins/prpl/qq/auto_get_authorize_info", TRUE);
 	purple_prefs_add_int("/plugins/prpl/qq/resend_interval", 4);
 	purple_prefs_add_int("/plugins/prpl/qq/resend_times", 10);
+	purple_prefs_add_int("/plugins/prpl/qq/worker_threads", 0);
 }
 
 PURPLE_INIT_PLUGIN(qq, init_plugin, info);
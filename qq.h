@@ -33,8 +33,16 @@
 #include "proxy.h"
 #include "roomlist.h"
 
+#include "qq_server.h"
+#include "qq_strpool.h"
+
 #define QQ_KEY_LENGTH       16
 
+/* tcp length, tag, client tag, cmd, seq, uid and header_fill */
+#define QQ_PACKET_HEADER_MAX	24
+/* uids, fill, client tag, uids again, session md5 and im type */
+#define QQ_IM_HEADER_LEN		53
+
 /* steal from kazehakase :) */
 #define qq_strlen(s) ((s)!=NULL?strlen(s):0)
 #define qq_strcmp(s1,s2) ((s1)!=NULL && (s2)!=NULL?strcmp(s1,s2):0)
@@ -45,6 +53,10 @@ typedef struct _qq_interval qq_interval;
 typedef struct _qq_net_stat qq_net_stat;
 typedef struct _qq_login_data qq_login_data;
 typedef struct _qq_captcha_data qq_captcha_data;
+typedef struct _qq_trans_pool qq_trans_pool;
+typedef struct _qq_worker qq_worker;
+typedef struct _qq_send_sched qq_send_sched;
+typedef struct _qq_im_frags qq_im_frags;
 
 struct _qq_captcha_data {
 	guint8 *token;
@@ -84,6 +96,13 @@ struct _qq_login_data {
 
 	guint8 *token_login;
 	guint16 token_login_len;
+
+	guint16 getlist_pages;		/* pages of login list, 0 before first reply */
+	guint16 getlist_rcved;
+
+	GTimeVal start_time;		/* keys set, touch is coming */
+	GTimeVal step_time;			/* last login reply */
+	glong login_ms;				/* whole login, shown in account info */
 };
 
 struct _qq_interval {
@@ -98,14 +117,18 @@ struct _qq_net_stat {
 	glong lost;
 	glong rcved;
 	glong rcved_dup;
+	glong keep_alive_skipped;
+	GTimeVal last_rcved;	/* any packet from server but keep alive reply */
+	GHashTable *cmds;	/* qq_cmd_stat per cmd and room_cmd, see qq_stat.h */
 };
 
 struct _qq_buddy_data {
 	guint32 uid;
 	guint16 face;		/* index: 0 - 299 */
+	guint8 icon;		/* stock icon shown, 0 if not set yet, see qq_update_buddy_icon */
 	guint8 age;
 	guint8 gender;
-	gchar *nickname;
+	qq_str *nickname;	/* interned in qq_data->str_pool */
 	struct in_addr ip;
 	guint16 port;
 	guint8 status;
@@ -148,6 +171,9 @@ struct _qq_data {
 
 	GList *servers;
 	gchar *curr_server;		/* point to servers->data, do not free*/
+	GSList *racers;			/* servers connecting in parallel, see qq_network.c */
+	qq_server_board *server_board;
+	GTimeVal connect_start;	/* connect or touch started, for server_board */
 
 	guint16 client_tag;
 	gint client_version;
@@ -165,11 +191,18 @@ struct _qq_data {
 
 	qq_interval itv_config;
 	qq_interval itv_count;
+	qq_interval itv_effect;		/* adapted to traffic, see liveness_adapt */
+	gint keep_alive_skipped;	/* in a row */
+	glong error_mark;			/* resend and lost seen by last tick */
+	gint online_changes;		/* buddies found changed by last update */
 	guint network_watcher;
-	guint time2resend;
 	gint resend_times;
+	qq_send_sched *send_sched;	/* paced outgoing packets, see qq_network.c */
+	gint worker_threads;	/* 0 to decrypt in main loop */
+	qq_worker *worker;		/* see qq_worker.c */
 
 	GList *transactions;	/* check ack packet and resend */
+	qq_trans_pool *trans_pool;	/* transactions and their payloads */
 
 	guint32 uid;			/* QQ number */
 	gchar * nickname;	/* QQ nickname */
@@ -180,6 +213,12 @@ struct _qq_data {
 	guint8 session_key[QQ_KEY_LENGTH];		/* later use this as key in this session */
 	guint8 session_md5[QQ_KEY_LENGTH];		/* concatenate my uid with session_key and md5 it */
 
+	/* prebuilt headers, only seq, time and length are patched per packet */
+	guint8 packet_header[QQ_PACKET_HEADER_MAX];
+	gint packet_header_len;		/* 0 if not built yet */
+	guint8 im_header[QQ_IM_HEADER_LEN];
+	gboolean is_im_header_ready;
+
 	guint16 send_seq;		/* send sequence number */
 	guint8 login_mode;		/* online of invisible */
 	gboolean is_login;		/* used by qq_add_buddy */
@@ -205,6 +244,10 @@ struct _qq_data {
 	GSList * buddy_list;
 	GSList * group_list;
 
+	qq_str_pool *str_pool;	/* nicknames and group names */
+	qq_im_frags *im_frags;	/* incoming IM being reassembled, see im_fragment.c */
+	GHashTable *image_names;	/* imgstore id to md5 file name of outgoing images */
+
 	PurpleRoomlist *roomlist;
 	GSList *rooms;
 
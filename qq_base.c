@@ -138,7 +138,7 @@ gboolean qq_process_keep_alive(guint8 *data, gint data_len, PurpleConnection *gc
 	return TRUE;
 }
 
-void qq_request_touch_server(PurpleConnection *gc)
+void qq_request_touch_server(PurpleConnection *gc, gint fd)
 {
 	qq_data *qd;
 	guint8 *buf, *raw_data;
@@ -172,7 +172,7 @@ void qq_request_touch_server(PurpleConnection *gc)
 	bytes += qq_putdata(buf + bytes, encrypted, encrypted_len);
 
 	qd->send_seq++;
-	qq_send_cmd_encrypted(gc, QQ_CMD_TOUCH_SERVER, qd->send_seq, buf, bytes, TRUE);
+	qq_send_cmd_encrypted_fd(gc, fd, QQ_CMD_TOUCH_SERVER, qd->send_seq, buf, bytes, TRUE);
 }
 
 guint16 qq_process_touch_server(PurpleConnection *gc, guint8 *data, gint data_len)
@@ -503,43 +503,6 @@ guint8 qq_process_captcha(PurpleConnection *gc, guint8 *data, gint data_len)
 	return QQ_LOGIN_REPLY_CAPTCHA_DLG;
 }
 
-/* source copy from gg's common.c */
-static guint32 crc32_table[256];
-static int crc32_initialized = 0;
-
-static void crc32_make_table()
-{
-	guint32 h = 1;
-	unsigned int i, j;
-
-	memset(crc32_table, 0, sizeof(crc32_table));
-
-	for (i = 128; i; i >>= 1) {
-		h = (h >> 1) ^ ((h & 1) ? 0xedb88320L : 0);
-
-		for (j = 0; j < 256; j += 2 * i)
-			crc32_table[i + j] = crc32_table[j] ^ h;
-	}
-
-	crc32_initialized = 1;
-}
-
-static guint32 crc32(guint32 crc, const guint8 *buf, int len)
-{
-	if (!crc32_initialized)
-		crc32_make_table();
-
-	if (!buf || len < 0)
-		return crc;
-
-	crc ^= 0xffffffffL;
-
-	while (len--)
-		crc = (crc >> 8) ^ crc32_table[(crc ^ *buf++) & 0xff];
-
-	return crc ^ 0xffffffffL;
-}
-
 void qq_request_auth(PurpleConnection *gc)
 {
 	qq_data *qd;
@@ -610,7 +573,7 @@ void qq_request_auth(PurpleConnection *gc)
 	/* len of random + len of CRC32, wrong */
 	bytes += qq_put16(raw_data + bytes, sizeof(qd->ld.random_key) + 4);
 	bytes += qq_putdata(raw_data + bytes, qd->ld.random_key, sizeof(qd->ld.random_key));
-	bytes += qq_put32(raw_data + bytes, crc32(0xFFFFFFFF, qd->ld.random_key, sizeof(qd->ld.random_key)));
+	bytes += qq_put32(raw_data + bytes, qq_crc32(0xFFFFFFFF, qd->ld.random_key, sizeof(qd->ld.random_key)));
 
 	bytes += qq_put32(raw_data + bytes, 0x01772E01);
 	bytes += qq_put32(raw_data + bytes, (rand() & 0x7fff) | ((rand() & 0x7fff) << 15));
@@ -1146,6 +1109,27 @@ guint8 qq_process_login( PurpleConnection *gc, guint8 *data, gint data_len)
 	return QQ_TOUCH_REPLY_REDIRECT;
 }
 
+/* E9, EA and the first page of list do not depend on each other,
+ * send them together right after login reply */
+void qq_request_login_followups( PurpleConnection *gc )
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+
+	qd->ld.getlist_pages = 0;
+	qd->ld.getlist_rcved = 0;
+
+	qq_request_login_E9(gc);
+	qq_request_login_EA(gc);
+	qq_request_login_getlist(gc, 0x0001);
+}
+
+/* all pages of list are received */
+void qq_request_login_finish( PurpleConnection *gc )
+{
+	qq_request_login_ED(gc);
+	qq_request_login_EC(gc);
+}
+
 void qq_request_login_E9( PurpleConnection *gc )
 {
 	qq_data *qd;
@@ -1230,13 +1214,16 @@ guint8 qq_process_login_getlist( PurpleConnection *gc, guint8 *data, gint data_l
 	qq_buddy_group * bg;
 	guint16 index_count;
 	guint16 index;
+	guint16 page;
 
 	g_return_val_if_fail(data != NULL && data_len != 0, QQ_LOGIN_REPLY_ERR);
 
 	qd = (qq_data *) gc->proto_data;
 
 	/* now initiate QQ Qun, do it first as it may take longer to finish */
-	qq_room_data_initial(gc);
+	if (qd->ld.getlist_rcved == 0) {
+		qq_room_data_initial(gc);
+	}
 	
 	//qq_show_packet("GETLIST", data, data_len);
 
@@ -1277,16 +1264,25 @@ guint8 qq_process_login_getlist( PurpleConnection *gc, guint8 *data, gint data_l
 			}
 		}
 	}
-	if (index < index_count)	//need request more
+	qd->ld.getlist_rcved++;
+	if (qd->ld.getlist_pages == 0) {
+		/* first reply tells how many pages, request all the rest at once */
+		qd->ld.getlist_pages = MAX(index_count, 1);
+		for (page = index + 1; page <= index_count; page++) {
+			qq_request_login_getlist(gc, page);
+		}
+	}
+
+	if (qd->ld.getlist_rcved < qd->ld.getlist_pages)	//need more
 	{
-		index++;
-		qq_request_login_getlist(gc, index);
-		return index;
-	} else {
-		/* clean deleted buddies */
-		qq_clean_group_buddy_list(gc);
-		return QQ_LOGIN_REPLY_OK;
+		purple_debug_info("QQ", "Got list page %d, %d of %d\n",
+				index, qd->ld.getlist_rcved, qd->ld.getlist_pages);
+		return qd->ld.getlist_rcved;
 	}
+
+	/* clean deleted buddies */
+	qq_clean_group_buddy_list(gc);
+	return QQ_LOGIN_REPLY_OK;
 }
 
 void qq_clean_group_buddy_list( PurpleConnection *gc )
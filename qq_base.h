@@ -61,7 +61,7 @@ void qq_request_keep_alive(PurpleConnection *gc);
 gboolean qq_process_keep_alive(guint8 *data, gint data_len, PurpleConnection *gc);
 
 /* for QQ2010 */
-void qq_request_touch_server(PurpleConnection *gc);
+void qq_request_touch_server(PurpleConnection *gc, gint fd);
 guint16 qq_process_touch_server(PurpleConnection *gc, guint8 *rcved, gint rcved_len);
 
 void qq_request_captcha(PurpleConnection *gc);
@@ -84,6 +84,8 @@ guint8 qq_process_verify_E3(PurpleConnection *gc, guint8 *data, gint data_len);
 void qq_request_login(PurpleConnection *gc);
 guint8 qq_process_login( PurpleConnection *gc, guint8 *data, gint data_len);
 
+void qq_request_login_followups(PurpleConnection *gc);
+void qq_request_login_finish(PurpleConnection *gc);
 void qq_request_login_E9(PurpleConnection *gc);
 void qq_request_login_EA(PurpleConnection *gc);
 void qq_request_login_getlist(PurpleConnection *gc, guint16 index);
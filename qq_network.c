@@ -29,13 +29,16 @@
 #include "buddy_info.h"
 #include "group_info.h"
 #include "group_internal.h"
+#include "im_fragment.h"
 #include "qq_crypt.h"
 #include "qq_define.h"
 #include "qq_base.h"
 #include "buddy_list.h"
 #include "packet_parse.h"
 #include "qq_network.h"
+#include "qq_stat.h"
 #include "qq_trans.h"
+#include "qq_worker.h"
 #include "utils.h"
 #include "qq_process.h"
 
@@ -47,8 +50,57 @@
 #define QQ_CONNECT_CHECK					5
 #define QQ_KEEP_ALIVE_INTERVAL		60
 #define QQ_TRANS_INTERVAL				10
+#define QQ_RACE_MAX							3		/* servers connected at the same time */
+#define QQ_RACE_STAGGER					250	/* in ms, between starts of two racers */
+#define QQ_KEEP_ALIVE_SKIP_MAX		2		/* in a row, while server is talking */
+#define QQ_UPDATE_STRETCH_MAX		4		/* times of configured update interval */
+#define QQ_SEND_TICK						50		/* in ms, drain queued packets */
+#define QQ_SEND_TOKEN						1000	/* one packet, tokens are in 1/1000 */
+
+/* pacing budget of each send class, packets per second and burst */
+static const struct {
+	gint rate;
+	gint burst;
+} send_budget[QQ_SEND_CLASSES] = {
+	{ 50, 20 },		/* QQ_SEND_INTERACTIVE */
+	{ 20, 10 },		/* QQ_SEND_CONTROL */
+	{ 20, 10 },		/* QQ_SEND_BULK */
+};
+
+/* a packet waiting for its class to have budget */
+typedef struct _qq_send_packet {
+	guint16 cmd;
+	guint16 seq;
+	gint fd;			/* connection it was sent for */
+	gint len;
+	guint8 *buf;		/* encapsulated, ready to write */
+} qq_send_packet;
+
+struct _qq_send_sched {
+	GQueue *queue[QQ_SEND_CLASSES];
+	gint tokens[QQ_SEND_CLASSES];
+	GTimeVal refill_time;
+	guint drain_timer;
+	GHashTable *queued;		/* SEND_KEY to count of packets in queue */
+};
+
+#define SEND_KEY(cmd, seq)	GUINT_TO_POINTER(((guint)(cmd) << 16) | (seq))
+
+/* one of the servers racing for the first touch reply */
+typedef struct _qq_racer {
+	PurpleConnection *gc;
+	gchar *server;		/* point to servers->data, do not free */
+	PurpleProxyConnectData *conn_data;
+	guint start_timer;
+	GTimeVal start_time;	/* connect, then touch started */
+	gint fd;
+} qq_racer;
 
 gboolean connect_to_server(PurpleConnection *gc, gchar *server, gint port);
+static void set_all_keys(PurpleConnection *gc);
+static void tcp_pending(gpointer data, gint source, PurpleInputCondition cond);
+static gboolean network_timeout(gpointer data);
+static void send_sched_free(qq_data *qd);
 
 static qq_connection *connection_find(qq_data *qd, int fd) {
 	qq_connection *ret = NULL;
@@ -94,11 +146,216 @@ static void connection_free_all(qq_data *qd) {
 		entry = qd->openconns;
 	}
 }
+/* split "host:port", return port */
+static gint server_split(const gchar *server, gchar **host)
+{
+	gchar **segments;
+	gint port;
+
+	segments = g_strsplit_set(server, ":", 0);
+	*host = g_strdup(segments[0]);
+	if (NULL != segments[1]) {
+		port = atoi(segments[1]);
+		if (port <= 0) {
+			purple_debug_info("QQ", "Port not define in %s, use default.\n", server);
+			port = QQ_DEFAULT_PORT;
+		}
+	} else {
+		purple_debug_info("QQ", "Error splitting server string: %s, setting port to default.\n", server);
+		port = QQ_DEFAULT_PORT;
+	}
+
+	g_strfreev(segments);
+	return port;
+}
+
+static void racer_free(qq_data *qd, qq_racer *racer, gboolean keep_fd)
+{
+	qd->racers = g_slist_remove(qd->racers, racer);
+
+	if (racer->start_timer > 0)	purple_timeout_remove(racer->start_timer);
+	if (racer->conn_data != NULL)	purple_proxy_connect_cancel(racer->conn_data);
+	if (racer->fd >= 0 && !keep_fd) {
+		qq_trans_remove_fd(racer->gc, racer->fd);
+		connection_remove(qd, racer->fd);
+	}
+	g_free(racer);
+}
+
+/* stop all racers, the servers are dropped if they could not answer in time */
+static void server_race_cancel(qq_data *qd, gboolean is_drop_servers)
+{
+	qq_racer *racer;
+
+	while (qd->racers != NULL) {
+		racer = (qq_racer *) qd->racers->data;
+		if (is_drop_servers) {
+			purple_debug_info("QQ", "Remove slow [%s] from server list\n", racer->server);
+			qd->servers = g_list_remove(qd->servers, racer->server);
+			qq_server_board_failed(qd->server_board, racer->server);
+		}
+		racer_free(qd, racer, FALSE);
+	}
+}
+
+static void racer_failed(qq_data *qd, qq_racer *racer)
+{
+	PurpleConnection *gc = racer->gc;
+
+	purple_debug_info("QQ", "Remove failed [%s] from server list\n", racer->server);
+	qd->servers = g_list_remove(qd->servers, racer->server);
+	qq_server_board_failed(qd->server_board, racer->server);
+	racer_free(qd, racer, FALSE);
+
+	if (qd->racers == NULL) {
+		/* all failed, start next race without waiting for connect_check */
+		if (qd->connect_watcher > 0)	purple_timeout_remove(qd->connect_watcher);
+		qd->connect_watcher = purple_timeout_add_seconds(QQ_CONNECT_INTERVAL, qq_connect_later, gc);
+	}
+}
+
+static void racer_connect_cb(gpointer data, gint source, const gchar *error_message)
+{
+	qq_racer *racer = (qq_racer *) data;
+	PurpleConnection *gc = racer->gc;
+	qq_data *qd;
+	qq_connection *conn;
+
+	racer->conn_data = NULL;
+	if (!PURPLE_CONNECTION_IS_VALID(gc)) {
+		purple_debug_info("QQ_CONN", "Invalid connection\n");
+		if (source >= 0)	close(source);
+		return;
+	}
+	qd = (qq_data *) gc->proto_data;
+
+	if (source < 0) {
+		purple_debug_info("QQ_CONN", "Could not connect to %s:\n%s\n", racer->server, error_message);
+		racer_failed(qd, racer);
+		return;
+	}
+
+	purple_debug_info("QQ_CONN", "Connected to %s, touch it\n", racer->server);
+	qq_server_board_connected(qd->server_board, racer->server, qq_elapsed_ms(&racer->start_time));
+	g_get_current_time(&racer->start_time);
+	racer->fd = source;
+	conn = connection_create(qd, source);
+	conn->input_handler = purple_input_add(source, PURPLE_INPUT_READ, tcp_pending, gc);
+
+	if (qd->network_watcher == 0) {
+		qd->network_watcher = purple_timeout_add_seconds(qd->itv_config.resend, network_timeout, gc);
+	}
+
+	/* qd->fd is set when one of racers wins, touch goes to this one only */
+	purple_connection_update_progress(gc, _("Getting server"), 2, QQ_CONNECT_STEPS);
+	qq_request_touch_server(gc, source);
+}
+
+static gboolean racer_start(gpointer data)
+{
+	qq_racer *racer = (qq_racer *) data;
+	PurpleConnection *gc = racer->gc;
+	qq_data *qd = (qq_data *) gc->proto_data;
+	gchar *host;
+	gint port;
+
+	racer->start_timer = 0;
+	g_get_current_time(&racer->start_time);
+
+	port = server_split(racer->server, &host);
+	purple_debug_info("QQ", "Race to %s:%d\n", host, port);
+	racer->conn_data = purple_proxy_connect(gc, purple_connection_get_account(gc),
+			host, port, racer_connect_cb, racer);
+	g_free(host);
+
+	if (racer->conn_data == NULL) {
+		racer_failed(qd, racer);
+	}
+	return FALSE;
+}
+
+/* connect several servers, each one started a bit later than the previous,
+ * the first answering touch wins and the others are closed */
+static gboolean server_race_start(PurpleConnection *gc)
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+	qq_racer *racer;
+	GSList *picked = NULL;
+	gchar *server;
+	const gchar *last;
+	GList *it;
+	gint i;
+
+	/* remove server used before */
+	if (qd->curr_server != NULL) {
+		purple_debug_info("QQ",
+			"Remove current [%s] from server list\n", qd->curr_server);
+		qd->servers = g_list_remove(qd->servers, qd->curr_server);
+		qd->curr_server = NULL;
+	}
+
+	for (i = 0; i < QQ_RACE_MAX; i++) {
+		server = NULL;
+		if (i == 0 && (last = qq_server_board_last_redirect(qd->server_board)) != NULL) {
+			/* start with where we were redirected last time */
+			it = g_list_find_custom(qd->servers, last, (GCompareFunc) strcmp);
+			if (it != NULL)	server = it->data;
+		}
+		if (server == NULL) {
+			server = qq_server_board_pick(qd->server_board, qd->servers, picked);
+		}
+		if (server == NULL || strlen(server) <= 0) {
+			break;
+		}
+		picked = g_slist_append(picked, server);
+
+		racer = g_new0(qq_racer, 1);
+		racer->gc = gc;
+		racer->server = server;
+		racer->fd = -1;
+		racer->start_timer = purple_timeout_add(i * QQ_RACE_STAGGER, racer_start, racer);
+		qd->racers = g_slist_append(qd->racers, racer);
+	}
+	g_slist_free(picked);
+
+	if (qd->racers == NULL) {
+		return FALSE;
+	}
+
+	/* all touch packets share one random key */
+	set_all_keys(gc);
+	purple_connection_update_progress(gc, _("Connecting to server"), 1, QQ_CONNECT_STEPS);
+	return TRUE;
+}
+
+/* touch reply arrived on fd, keep that server and close the rest */
+static void server_race_finish(PurpleConnection *gc, gint fd)
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+	qq_racer *winner = NULL;
+	GSList *it;
+
+	for (it = qd->racers; it != NULL; it = it->next) {
+		if (((qq_racer *) it->data)->fd == fd) {
+			winner = (qq_racer *) it->data;
+			break;
+		}
+	}
+	g_return_if_fail(winner != NULL);
+
+	purple_debug_info("QQ", "Server %s wins\n", winner->server);
+	qd->fd = fd;
+	qd->curr_server = winner->server;
+	qd->connect_start = winner->start_time;
+	qd->connect_retry = QQ_CONNECT_MAX;
+
+	racer_free(qd, winner, TRUE);
+	server_race_cancel(qd, FALSE);
+}
+
 static gboolean set_new_server(qq_data *qd)
 {
 	gint count;
-	gint index;
-	GList *it = NULL;
 
  	g_return_val_if_fail(qd != NULL, FALSE);
 
@@ -123,12 +380,10 @@ static gboolean set_new_server(qq_data *qd)
 		return FALSE;
 	}
 
-	/* get new server */
-	index  = rand() % count;
-	it = g_list_nth(qd->servers, index);
-	qd->curr_server = it->data;		/* do not free server_name */
+	/* get new server, faster ones are more likely */
+	qd->curr_server = qq_server_board_pick(qd->server_board, qd->servers, NULL);
 	if (qd->curr_server == NULL || strlen(qd->curr_server) <= 0 ) {
-		purple_debug_info("QQ", "Server name at %d is empty\n", index);
+		purple_debug_info("QQ", "Server name is empty\n");
 		return FALSE;
 	}
 
@@ -166,6 +421,13 @@ static gboolean connect_check(gpointer data)
 		return FALSE;
 	}
 
+	/* nobody answered touch in time */
+	if (qd->racers != NULL) {
+		server_race_cancel(qd, TRUE);
+	} else if (qd->curr_server != NULL) {
+		qq_server_board_failed(qd->server_board, qd->curr_server);
+	}
+
 	qd->connect_watcher = purple_timeout_add_seconds(0, qq_connect_later, gc);
 	return FALSE;
 }
@@ -178,7 +440,6 @@ gboolean qq_connect_later(gpointer data)
 	PurpleConnection *gc;
 	char *tmp_server;
 	int port;
-	gchar **segments;
 	qq_data *qd;
 
 	gc = (PurpleConnection *) data;
@@ -193,12 +454,15 @@ gboolean qq_connect_later(gpointer data)
 	qq_disconnect(gc);
 
 	if (qd->redirect_ip.s_addr != 0) {
-		/* redirect to new server */
+		/* redirect to new server, remembered for next login */
 		tmp_server = g_strdup_printf("%s:%d", inet_ntoa(qd->redirect_ip), qd->redirect_port);
-		qd->servers = g_list_append(qd->servers, tmp_server);
-
-		qd->curr_server = tmp_server;
+		qd->curr_server = (gchar *) qq_server_board_redirected(qd->server_board,
+				qd->curr_server, tmp_server);
+		g_free(tmp_server);
 		tmp_server = NULL;
+		if (g_list_find(qd->servers, qd->curr_server) == NULL) {
+			qd->servers = g_list_append(qd->servers, qd->curr_server);
+		}
 
 		qd->redirect_ip.s_addr = 0;
 		qd->redirect_port = 0;
@@ -206,6 +470,17 @@ gboolean qq_connect_later(gpointer data)
 	}
 
 	if (qd->curr_server == NULL || strlen (qd->curr_server) == 0 || qd->connect_retry <= 0) {
+		if (qd->use_tcp) {
+			if ( !server_race_start(gc)) {
+				purple_connection_error_reason(gc,
+						PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+						_("Unable to connect"));
+				return FALSE;
+			}
+			qd->check_watcher = purple_timeout_add_seconds(QQ_CONNECT_CHECK, connect_check, gc);
+			return FALSE;
+		}
+
 		if ( set_new_server(qd) != TRUE) {
 			purple_connection_error_reason(gc,
 					PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
@@ -215,20 +490,7 @@ gboolean qq_connect_later(gpointer data)
 		qd->connect_retry = QQ_CONNECT_MAX;
 	}
 
-	segments = g_strsplit_set(qd->curr_server, ":", 0);
-	tmp_server = g_strdup(segments[0]);
-	if (NULL != segments[1]) {
-		port = atoi(segments[1]);
-		if (port <= 0) {
-			purple_debug_info("QQ", "Port not define in %s, use default.\n", qd->curr_server);
-			port = QQ_DEFAULT_PORT;
-		}
-	} else {
-		purple_debug_info("QQ", "Error splitting server string: %s, setting port to default.\n", qd->curr_server);
-		port = QQ_DEFAULT_PORT;
-	}
-
-	g_strfreev(segments);
+	port = server_split(qd->curr_server, &tmp_server);
 
 	qd->connect_retry--;
 	if ( !connect_to_server(gc, tmp_server, port) ) {
@@ -258,7 +520,7 @@ static void redirect_server(PurpleConnection *gc)
 }
 
 /* process the incoming packet from qq_pending */
-static gboolean packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
+static gboolean packet_process(PurpleConnection *gc, gint source, guint8 *buf, gint buf_len)
 {
 	qq_data *qd;
 	gint bytes, bytes_not_read;
@@ -272,6 +534,7 @@ static gboolean packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
 	guint32 update_class; 
 	guintptr ship_value;
 	int ret;
+	GHashTable *cmd_stats;
 
 	qq_transaction *trans;
 
@@ -280,12 +543,22 @@ static gboolean packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
 	qd = (qq_data *) gc->proto_data;
 
 	qd->net_stat.rcved++;
-	if (qd->net_stat.rcved <= 0)	memset(&(qd->net_stat), 0, sizeof(qd->net_stat));
+	if (qd->net_stat.rcved <= 0) {
+		/* counters wrapped, per command statistics are kept */
+		cmd_stats = qd->net_stat.cmds;
+		memset(&(qd->net_stat), 0, sizeof(qd->net_stat));
+		qd->net_stat.cmds = cmd_stats;
+	}
 
 	/* Len, header and tail tag have been checked before */
 	bytes = 0;
 	bytes += packet_get_header(&header_tag, &version_tag, &cmd, &seq, buf + bytes);
 
+	/* reply to our own keep alive does not tell that server is talking */
+	if (cmd != QQ_CMD_KEEP_ALIVE) {
+		g_get_current_time(&qd->net_stat.last_rcved);
+	}
+
 #if 1
 		purple_debug_info("QQ", "==> [%05d] %s 0x%04X, version tag 0x%04X len %d\n",
 				seq, qq_get_cmd_desc(cmd), cmd, version_tag, buf_len);
@@ -296,14 +569,22 @@ static gboolean packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
 	
 	/* ack packet, we need to update send tranactions */
 	/* we do not check duplication for server ack */
-	trans = qq_trans_find_rcved(gc, cmd, seq);
+	trans = qq_trans_find_rcved(gc, cmd, seq, bytes_not_read);
 	if (trans == NULL) {
-		/* new server command */
-		if ( !qd->is_login ) {
+		if (qq_trans_server_dup(gc, cmd, seq)) {
+			qd->net_stat.rcved_dup++;
+			purple_debug_info("QQ", "dup [%05d] %s, discard...\n", seq, qq_get_cmd_desc(cmd));
+			return TRUE;
+		}
+		/* new server command, keep order with those before login */
+		if ( !qd->is_login || qq_trans_has_remained(gc)) {
 			qq_trans_add_remain(gc, cmd, seq, buf + bytes, bytes_not_read);
 		} else {
 			qq_trans_add_server_cmd(gc, cmd, seq, buf + bytes, bytes_not_read);
-			qq_proc_server_cmd(gc, cmd, seq, buf + bytes, bytes_not_read);
+			if (!qq_worker_push(gc, QQ_WORKER_SERVER_CMD, cmd, seq, 0, 0,
+						buf + bytes, bytes_not_read, 0, 0)) {
+				qq_proc_server_cmd(gc, cmd, seq, buf + bytes, bytes_not_read);
+			}
 		}
 		return TRUE;
 	}
@@ -320,6 +601,16 @@ static gboolean packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
 		purple_debug_info("QQ", "Update class %d, ship_value %d\n", update_class, ship_value);
 	}
 
+	if (cmd == QQ_CMD_TOUCH_SERVER) {
+		if (qd->racers != NULL) {
+			server_race_finish(gc, source);
+		}
+		if (qd->curr_server != NULL) {
+			qq_server_board_touched(qd->server_board, qd->curr_server, qq_elapsed_ms(&qd->connect_start));
+			qq_server_board_save(qd->server_board);
+		}
+	}
+
 	switch (cmd) {
 		case QQ_CMD_TOUCH_SERVER:
 		case QQ_CMD_CAPTCHA:
@@ -333,6 +624,9 @@ static gboolean packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
 		case QQ_CMD_LOGIN_GETLIST:
 		case QQ_CMD_LOGIN_ED:
 		case QQ_CMD_LOGIN_EC:
+			/* GETLIST, ED and EC come after is_login, keep them behind
+			 * the replies pushed to the workers before */
+			qq_worker_flush(gc);
 			ret = qq_proc_login_cmds(gc, cmd, seq, buf + bytes, bytes_not_read, update_class, ship_value);
 			if (ret != QQ_LOGIN_REPLY_OK) {
 				if (ret == QQ_TOUCH_REPLY_REDIRECT) {
@@ -344,9 +638,17 @@ static gboolean packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
 		case QQ_CMD_ROOM:
 			room_cmd = qq_trans_get_room_cmd(trans);
 			room_id = qq_trans_get_room_id(trans);
+			if (qd->is_login && qq_worker_push(gc, QQ_WORKER_ROOM_CMD, cmd, seq, room_cmd, room_id,
+						buf + bytes, bytes_not_read, update_class, ship_value)) {
+				break;
+			}
 			qq_proc_room_cmds(gc, seq, room_cmd, room_id, buf + bytes, bytes_not_read, update_class, ship_value);
 			break;
 		default:
+			if (qd->is_login && qq_worker_push(gc, QQ_WORKER_CLIENT_CMD, cmd, seq, 0, 0,
+						buf + bytes, bytes_not_read, update_class, ship_value)) {
+				break;
+			}
 			qq_proc_client_cmds(gc, cmd, seq, buf + bytes, bytes_not_read, update_class, ship_value);
 			break;
 	}
@@ -481,7 +783,7 @@ static void tcp_pending(gpointer data, gint source, PurpleInputCondition cond)
 		/* packet_process may call disconnect and destory data like conn
 		 * do not call packet_process before jump,
 		 * break if packet_process return FALSE */
-		if (packet_process(gc, pkt, pkt_len - bytes) == FALSE) {
+		if (packet_process(gc, source, pkt, pkt_len - bytes) == FALSE) {
 			purple_debug_info("TCP_PENDING", "Connection has been destory\n");
 			break;
 		}
@@ -532,10 +834,10 @@ static void udp_pending(gpointer data, gint source, PurpleInputCondition cond)
 	/* packet_process may call disconnect and destory data like conn
 	 * do not call packet_process before jump,
 	 * break if packet_process return FALSE */
-	packet_process(gc, buf, buf_len);
+	packet_process(gc, source, buf, buf_len);
 }
 
-static gint udp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
+static gint udp_send_out(PurpleConnection *gc, gint fd, guint8 *data, gint data_len)
 {
 	qq_data *qd;
 	gint ret;
@@ -546,11 +848,11 @@ static gint udp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
 	qd = (qq_data *) gc->proto_data;
 
 #if 0
-	purple_debug_info("UDP_SEND_OUT", "Send %d bytes to socket %d\n", data_len, qd->fd);
+	purple_debug_info("UDP_SEND_OUT", "Send %d bytes to socket %d\n", data_len, fd);
 #endif
 
 	errno = 0;
-	ret = send(qd->fd, data, data_len, 0);
+	ret = send(fd, data, data_len, 0);
 	if (ret < 0 && errno == EAGAIN) {
 		return ret;
 	}
@@ -603,7 +905,7 @@ static void tcp_can_write(gpointer data, gint source, PurpleInputCondition cond)
 	purple_circ_buffer_mark_read(conn->tcp_txbuf, ret);
 }
 
-static gint tcp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
+static gint tcp_send_out(PurpleConnection *gc, gint fd, guint8 *data, gint data_len)
 {
 	qq_data *qd;
 	qq_connection *conn;
@@ -614,15 +916,15 @@ static gint tcp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
 	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, -1);
 	qd = (qq_data *) gc->proto_data;
 
-	conn = connection_find(qd, qd->fd);
+	conn = connection_find(qd, fd);
 	g_return_val_if_fail(conn, -1);
 
 #if 0
-	purple_debug_info("TCP_SEND_OUT", "Send %d bytes to socket %d\n", data_len, qd->fd);
+	purple_debug_info("TCP_SEND_OUT", "Send %d bytes to socket %d\n", data_len, fd);
 #endif
 
 	if (conn->can_write_handler == 0) {
-		ret = write(qd->fd, data, data_len);
+		ret = write(fd, data, data_len);
 	} else {
 		ret = -1;
 		errno = EAGAIN;
@@ -630,7 +932,7 @@ static gint tcp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
 
 	/*
 	purple_debug_info("TCP_SEND_OUT",
-		"Socket %d, total %d bytes is sent %d\n", qd->fd, data_len, ret);
+		"Socket %d, total %d bytes is sent %d\n", fd, data_len, ret);
 	*/
 	if (ret < 0 && errno == EAGAIN) {
 		/* socket is busy, send later */
@@ -641,7 +943,7 @@ static gint tcp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
 		gchar *tmp = g_strdup_printf(_("Lost connection with server: %s"),
 				g_strerror(errno));
 		purple_debug_error("TCP_SEND_OUT",
-			"Send to socket %d failed: %d, %s\n", qd->fd, errno, g_strerror(errno));
+			"Send to socket %d failed: %d, %s\n", fd, errno, g_strerror(errno));
 		purple_connection_error_reason(gc,
 				PURPLE_CONNECTION_ERROR_NETWORK_ERROR, tmp);
 		g_free(tmp);
@@ -651,7 +953,7 @@ static gint tcp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
 	if (ret < data_len) {
 		purple_debug_info("TCP_SEND_OUT", "Add %d bytes to buffer\n", data_len - ret);
 		if (conn->can_write_handler == 0) {
-			conn->can_write_handler = purple_input_add(qd->fd, PURPLE_INPUT_WRITE, tcp_can_write, gc);
+			conn->can_write_handler = purple_input_add(fd, PURPLE_INPUT_WRITE, tcp_can_write, gc);
 		}
 		if (conn->tcp_txbuf == NULL) {
 			conn->tcp_txbuf = purple_circ_buffer_new(4096);
@@ -661,6 +963,27 @@ static gint tcp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
 	return ret;
 }
 
+/* tighten keep alive and update after resend or lost packets */
+static void liveness_adapt(qq_data *qd)
+{
+	glong errors;
+
+	errors = qd->net_stat.resend + qd->net_stat.lost;
+	if (errors > qd->error_mark) {
+		qd->itv_effect.keep_alive = MAX(qd->itv_config.keep_alive / 2, 1);
+		qd->itv_effect.update = qd->itv_config.update;
+		if (qd->itv_count.keep_alive > qd->itv_effect.keep_alive) {
+			qd->itv_count.keep_alive = qd->itv_effect.keep_alive;
+		}
+		if (qd->itv_count.update > qd->itv_effect.update) {
+			qd->itv_count.update = qd->itv_effect.update;
+		}
+		qd->keep_alive_skipped = 0;
+	}
+	/* also reset when counters wrapped */
+	qd->error_mark = errors;
+}
+
 static gboolean network_timeout(gpointer data)
 {
 	PurpleConnection *gc = (PurpleConnection *) data;
@@ -682,11 +1005,29 @@ static gboolean network_timeout(gpointer data)
 		return TRUE;
 	}
 
+	liveness_adapt(qd);
+
 	qd->itv_count.keep_alive--;
 	if (qd->itv_count.keep_alive <= 0) {
-		qd->itv_count.keep_alive = qd->itv_config.keep_alive;
-		qq_request_keep_alive(gc);
-		return TRUE;
+		/* recover slowly after network errors */
+		if (qd->itv_effect.keep_alive < qd->itv_config.keep_alive) {
+			qd->itv_effect.keep_alive++;
+		}
+		qd->itv_count.keep_alive = qd->itv_effect.keep_alive;
+
+		/* server talked to us lately, session is alive */
+		if (qd->itv_effect.keep_alive >= qd->itv_config.keep_alive
+				&& qd->keep_alive_skipped < QQ_KEEP_ALIVE_SKIP_MAX
+				&& qq_elapsed_ms(&qd->net_stat.last_rcved)
+					< qd->itv_effect.keep_alive * qd->itv_config.resend * 1000) {
+			qd->keep_alive_skipped++;
+			qd->net_stat.keep_alive_skipped++;
+			purple_debug_info("QQ", "Traffic seen, skip keep alive\n");
+		} else {
+			qd->keep_alive_skipped = 0;
+			qq_request_keep_alive(gc);
+			return TRUE;
+		}
 	}
 
 	if (qd->itv_config.update <= 0) {
@@ -695,7 +1036,16 @@ static gboolean network_timeout(gpointer data)
 
 	qd->itv_count.update--;
 	if (qd->itv_count.update <= 0) {
-		qd->itv_count.update = qd->itv_config.update;
+		/* nothing changed since last update, wait longer next time */
+		if (qd->online_changes > 0) {
+			qd->itv_effect.update = qd->itv_config.update;
+		} else if (qd->itv_effect.update < qd->itv_config.update * QQ_UPDATE_STRETCH_MAX) {
+			qd->itv_effect.update += MAX(qd->itv_effect.update / 2, 1);
+			qd->itv_effect.update = MIN(qd->itv_effect.update,
+					qd->itv_config.update * QQ_UPDATE_STRETCH_MAX);
+		}
+		qd->online_changes = 0;
+		qd->itv_count.update = qd->itv_effect.update;
 		qq_update_online(gc, 0);
 		return TRUE;
 	}
@@ -722,6 +1072,8 @@ static void set_all_keys(PurpleConnection *gc)
 	qd->send_seq = rand() & 0xffff;
 
 	qd->is_login = FALSE;
+	g_get_current_time(&qd->ld.start_time);
+	qd->ld.step_time = qd->ld.start_time;
 	qd->uid = strtoul(purple_account_get_username(purple_connection_get_account(gc)), NULL, 10);
 
 #ifdef DEBUG
@@ -774,11 +1126,19 @@ static void connect_cb(gpointer data, gint source, const gchar *error_message)
 
 	if (source < 0) {	/* socket returns -1 */
 		purple_debug_info("QQ_CONN", "Could not establish a connection with the server:\n%s\n", error_message);
+		if (qd->curr_server != NULL) {
+			qq_server_board_failed(qd->server_board, qd->curr_server);
+		}
 		if (qd->connect_watcher > 0)	purple_timeout_remove(qd->connect_watcher);
 		qd->connect_watcher = purple_timeout_add_seconds(QQ_CONNECT_INTERVAL, qq_connect_later, gc);
 		return;
 	}
 
+	if (qd->curr_server != NULL) {
+		qq_server_board_connected(qd->server_board, qd->curr_server, qq_elapsed_ms(&qd->connect_start));
+	}
+	g_get_current_time(&qd->connect_start);
+
 	/* _qq_show_socket("Got login socket", source); */
 	qd->fd = source;
 	conn = connection_create(qd, source);
@@ -794,7 +1154,7 @@ static void connect_cb(gpointer data, gint source, const gchar *error_message)
 	set_all_keys( gc );
 
 	purple_connection_update_progress(gc, _("Getting server"), 2, QQ_CONNECT_STEPS);
-	qq_request_touch_server(gc);
+	qq_request_touch_server(gc, qd->fd);
 	return;
 }
 
@@ -954,6 +1314,7 @@ gboolean connect_to_server(PurpleConnection *gc, gchar *server, gint port)
 	purple_connection_update_progress(gc, _("Connecting to server"), 1, QQ_CONNECT_STEPS);
 
 	purple_debug_info("QQ", "Connect to %s:%d\n", server, port);
+	g_get_current_time(&qd->connect_start);
 
 	if (qd->conn_data != NULL) {
 		purple_proxy_connect_cancel(qd->conn_data);
@@ -1004,6 +1365,8 @@ void qq_disconnect(PurpleConnection *gc)
 
 	purple_debug_info("QQ", "Disconnecting...\n");
 
+	qq_worker_stop(gc);
+
 	if (qd->network_watcher > 0) {
 		purple_debug_info("QQ", "Remove network watcher\n");
 		purple_timeout_remove(qd->network_watcher);
@@ -1032,10 +1395,12 @@ void qq_disconnect(PurpleConnection *gc)
 		qd->udp_query_data = NULL;
 	}
 #endif
+	server_race_cancel(qd, FALSE);
 	connection_free_all(qd);
 	qd->fd = -1;
 
 	qq_trans_remove_all(gc);
+	qq_im_frag_remove_all(gc);
 
 	memset(qd->ld.random_key, 0, sizeof(qd->ld.random_key));
 	memset(qd->ld.pwd_md5, 0, sizeof(qd->ld.pwd_md5));
@@ -1043,11 +1408,11 @@ void qq_disconnect(PurpleConnection *gc)
 	memset(qd->ld.pwd_qq_md5, 0, sizeof(qd->ld.pwd_qq_md5));
 	memset(qd->session_key, 0, sizeof(qd->session_key));
 	memset(qd->session_md5, 0, sizeof(qd->session_md5));
+	qd->packet_header_len = 0;
+	qd->is_im_header_ready = FALSE;
+	send_sched_free(qd);
 
-	g_slist_foreach(qd->group_list,g_free,NULL);
-	g_slist_free(qd->group_list);
-	qd->group_list = NULL;
-	
+	qq_group_list_free_all(gc);
 
 	qd->my_local_ip.s_addr = 0;
 	qd->my_ip.s_addr = 0;
@@ -1057,29 +1422,50 @@ void qq_disconnect(PurpleConnection *gc)
 	qq_buddy_data_free_all(gc);
 }
 
-static gint packet_encap(qq_data *qd, guint8 *buf, gint maxlen, guint16 cmd, guint16 seq,
-	guint8 *data, gint data_len)
+/* build the part of packet header not changed during the session,
+ * shared by every cmd including keep-alive, typing and get onlines.
+ * Their payloads are 5 to 11 bytes put on the stack, so they are built
+ * per packet instead of kept as templates */
+static void packet_header_build(qq_data *qd)
 {
 	gint bytes = 0;
-	g_return_val_if_fail(qd != NULL && buf != NULL && maxlen > 0, -1);
-	g_return_val_if_fail(data != NULL && data_len > 0, -1);
 
 	/* QQ TCP packet has two bytes in the begining defines packet length
 	 * so leave room here to store packet size */
 	if (qd->use_tcp) {
-		bytes += qq_put16(buf + bytes, 0x0000);
+		bytes += qq_put16(qd->packet_header + bytes, 0x0000);
 	}
 	/* now comes the normal QQ packet as UDP */
-	bytes += qq_put8(buf + bytes, QQ_PACKET_TAG);
-	bytes += qq_put16(buf + bytes, qd->client_tag);
-	
-	bytes += qq_put16(buf + bytes, cmd);
+	bytes += qq_put8(qd->packet_header + bytes, QQ_PACKET_TAG);
+	bytes += qq_put16(qd->packet_header + bytes, qd->client_tag);
+	/* cmd and seq, patched per packet */
+	bytes += qq_put16(qd->packet_header + bytes, 0x0000);
+	bytes += qq_put16(qd->packet_header + bytes, 0x0000);
 
-	bytes += qq_put16(buf + bytes, seq);
+	bytes += qq_put32(qd->packet_header + bytes, qd->uid);
 
-	bytes += qq_put32(buf + bytes, qd->uid);
+	bytes += qq_putdata(qd->packet_header + bytes, header_fill, sizeof(header_fill));
+	qd->packet_header_len = bytes;
+}
 
-	bytes += qq_putdata(buf + bytes,header_fill,sizeof(header_fill));
+static gint packet_encap(qq_data *qd, guint8 *buf, gint maxlen, guint16 cmd, guint16 seq,
+	guint8 *data, gint data_len)
+{
+	gint bytes;
+	gint offset;
+	g_return_val_if_fail(qd != NULL && buf != NULL && maxlen > 0, -1);
+	g_return_val_if_fail(data != NULL && data_len > 0, -1);
+
+	if (qd->packet_header_len <= 0) {
+		packet_header_build(qd);
+	}
+	g_return_val_if_fail(qd->packet_header_len + data_len + 1 <= maxlen, -1);
+
+	bytes = qq_putdata(buf, qd->packet_header, qd->packet_header_len);
+	/* cmd follows the tag and client tag */
+	offset = qd->use_tcp ? 5 : 3;
+	offset += qq_put16(buf + offset, cmd);
+	qq_put16(buf + offset, seq);
 
 	bytes += qq_putdata(buf + bytes, data, data_len);
 	bytes += qq_put8(buf + bytes, QQ_PACKET_TAIL);
@@ -1092,36 +1478,247 @@ static gint packet_encap(qq_data *qd, guint8 *buf, gint maxlen, guint16 cmd, gui
 	return bytes;
 }
 
-/* data has been encrypted before */
-static gint packet_send_out(PurpleConnection *gc, guint16 cmd, guint16 seq, guint8 *data, gint data_len)
+/* keep IM and acks ahead of keep-alive, and both ahead of buddy and room sync */
+static gint send_class_get(qq_data *qd, guint16 cmd, guint8 room_cmd)
+{
+	if ( !qd->is_login ) {
+		return QQ_SEND_CONTROL;
+	}
+
+	switch (cmd) {
+		case QQ_CMD_SEND_IM:
+		case QQ_CMD_SEND_TYPING:
+		case QQ_CMD_ACK_SYS_MSG:
+		/* replies to server commands */
+		case QQ_CMD_RECV_IM:
+		case QQ_CMD_RECV_IM_CE:
+		case QQ_CMD_RECV_MSG_SYS:
+		case QQ_CMD_BUDDY_CHANGE_STATUS:
+			return QQ_SEND_INTERACTIVE;
+		case QQ_CMD_ROOM:
+			return (room_cmd == QQ_ROOM_CMD_SEND_IM) ? QQ_SEND_INTERACTIVE : QQ_SEND_BULK;
+		case QQ_CMD_KEEP_ALIVE:
+		case QQ_CMD_LOGOUT:
+		case QQ_CMD_CHANGE_STATUS:
+		case QQ_CMD_TOUCH_SERVER:
+		case QQ_CMD_CAPTCHA:
+		case QQ_CMD_AUTH:
+		case QQ_CMD_VERIFY_DE:
+		case QQ_CMD_VERIFY_E5:
+		case QQ_CMD_VERIFY_E3:
+		case QQ_CMD_LOGIN:
+		case QQ_CMD_LOGIN_E9:
+		case QQ_CMD_LOGIN_EA:
+		case QQ_CMD_LOGIN_GETLIST:
+		case QQ_CMD_LOGIN_ED:
+		case QQ_CMD_LOGIN_EC:
+			return QQ_SEND_CONTROL;
+		default:
+			return QQ_SEND_BULK;
+	}
+}
+
+static gint send_write(PurpleConnection *gc, gint fd, guint8 *buf, gint buf_len)
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+
+	if (qd->use_tcp) {
+		return tcp_send_out(gc, fd, buf, buf_len);
+	}
+	return udp_send_out(gc, fd, buf, buf_len);
+}
+
+static qq_send_sched *send_sched_get(qq_data *qd)
+{
+	qq_send_sched *sched;
+	gint i;
+
+	if (qd->send_sched != NULL) {
+		return qd->send_sched;
+	}
+
+	sched = g_new0(qq_send_sched, 1);
+	for (i = 0; i < QQ_SEND_CLASSES; i++) {
+		sched->queue[i] = g_queue_new();
+		sched->tokens[i] = send_budget[i].burst * QQ_SEND_TOKEN;
+	}
+	g_get_current_time(&sched->refill_time);
+	sched->queued = g_hash_table_new(g_direct_hash, g_direct_equal);
+	qd->send_sched = sched;
+	return sched;
+}
+
+static void send_sched_refill(qq_send_sched *sched)
+{
+	glong elapsed;
+	gint i;
+
+	elapsed = qq_elapsed_ms(&sched->refill_time);
+	if (elapsed <= 0) {
+		return;
+	}
+	g_get_current_time(&sched->refill_time);
+
+	/* long idle would overflow, anyway all buckets are full then */
+	if (elapsed > 60 * 1000) elapsed = 60 * 1000;
+	for (i = 0; i < QQ_SEND_CLASSES; i++) {
+		sched->tokens[i] += elapsed * send_budget[i].rate;
+		if (sched->tokens[i] > send_budget[i].burst * QQ_SEND_TOKEN) {
+			sched->tokens[i] = send_budget[i].burst * QQ_SEND_TOKEN;
+		}
+	}
+}
+
+/* the same cmd and seq may be queued again by a resend */
+static void send_sched_queued_inc(qq_send_sched *sched, qq_send_packet *pkt)
+{
+	guint count;
+
+	count = GPOINTER_TO_UINT(g_hash_table_lookup(sched->queued, SEND_KEY(pkt->cmd, pkt->seq)));
+	g_hash_table_insert(sched->queued, SEND_KEY(pkt->cmd, pkt->seq), GUINT_TO_POINTER(count + 1));
+}
+
+static void send_sched_queued_dec(qq_send_sched *sched, qq_send_packet *pkt)
+{
+	guint count;
+
+	count = GPOINTER_TO_UINT(g_hash_table_lookup(sched->queued, SEND_KEY(pkt->cmd, pkt->seq)));
+	if (count > 1) {
+		g_hash_table_insert(sched->queued, SEND_KEY(pkt->cmd, pkt->seq), GUINT_TO_POINTER(count - 1));
+	} else {
+		g_hash_table_remove(sched->queued, SEND_KEY(pkt->cmd, pkt->seq));
+	}
+}
+
+static gboolean send_sched_drain(gpointer data)
+{
+	PurpleConnection *gc = (PurpleConnection *) data;
+	qq_data *qd;
+	qq_send_sched *sched;
+	qq_send_packet *pkt;
+	gboolean is_empty = TRUE;
+	gint i;
+
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, FALSE);
+	qd = (qq_data *) gc->proto_data;
+	sched = qd->send_sched;
+	g_return_val_if_fail(sched != NULL, FALSE);
+
+	send_sched_refill(sched);
+	for (i = 0; i < QQ_SEND_CLASSES; i++) {
+		while (!g_queue_is_empty(sched->queue[i]) && sched->tokens[i] >= QQ_SEND_TOKEN) {
+			pkt = (qq_send_packet *) g_queue_pop_head(sched->queue[i]);
+			sched->tokens[i] -= QQ_SEND_TOKEN;
+			send_sched_queued_dec(sched, pkt);
+			if (connection_find(qd, pkt->fd) != NULL) {
+				send_write(gc, pkt->fd, pkt->buf, pkt->len);
+			} else {
+				purple_debug_info("QQ", "Drop [%05d] %s, socket %d is closed\n",
+						pkt->seq, qq_get_cmd_desc(pkt->cmd), pkt->fd);
+			}
+			g_free(pkt->buf);
+			g_free(pkt);
+		}
+		if (!g_queue_is_empty(sched->queue[i])) {
+			is_empty = FALSE;
+		}
+	}
+
+	if (is_empty) {
+		sched->drain_timer = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* drop queued packets, they are still kept by transactions */
+static void send_sched_free(qq_data *qd)
+{
+	qq_send_sched *sched;
+	qq_send_packet *pkt;
+	gint i;
+
+	sched = qd->send_sched;
+	if (sched == NULL) {
+		return;
+	}
+	qd->send_sched = NULL;
+
+	if (sched->drain_timer > 0) {
+		purple_timeout_remove(sched->drain_timer);
+	}
+	for (i = 0; i < QQ_SEND_CLASSES; i++) {
+		while ((pkt = (qq_send_packet *) g_queue_pop_head(sched->queue[i])) != NULL) {
+			g_free(pkt->buf);
+			g_free(pkt);
+		}
+		g_queue_free(sched->queue[i]);
+	}
+	g_hash_table_destroy(sched->queued);
+	g_free(sched);
+}
+
+/* packet of this cmd and seq is still waiting in send queue */
+gboolean qq_send_is_queued(PurpleConnection *gc, guint16 cmd, guint16 seq)
 {
 	qq_data *qd;
+
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, FALSE);
+	qd = (qq_data *) gc->proto_data;
+	if (qd->send_sched == NULL) {
+		return FALSE;
+	}
+	return g_hash_table_lookup(qd->send_sched->queued, SEND_KEY(cmd, seq)) != NULL;
+}
+
+/* data has been encrypted before, fd is the connection to send it through */
+static gint packet_send_out(PurpleConnection *gc, gint fd, gint send_class,
+		guint16 cmd, guint16 seq, guint8 *data, gint data_len)
+{
+	qq_data *qd;
+	qq_send_sched *sched;
+	qq_send_packet *pkt;
 	guint8 *buf;
 	gint buf_len;
-	gint bytes_sent;
 
 	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, -1);
 	qd = (qq_data *)gc->proto_data;
 	g_return_val_if_fail(data != NULL && data_len > 0, -1);
+	g_return_val_if_fail(send_class >= 0 && send_class < QQ_SEND_CLASSES, -1);
 
+	/* every byte is written by packet_encap, no need to clear */
 	buf = g_newa(guint8, MAX_PACKET_SIZE);
-	memset(buf, 0, MAX_PACKET_SIZE);
 	buf_len = packet_encap(qd, buf, MAX_PACKET_SIZE, cmd, seq, data, data_len);
 	if (buf_len <= 0) {
 		return -1;
 	}
 
 	qd->net_stat.sent++;
-	if (qd->use_tcp) {
-		bytes_sent = tcp_send_out(gc, buf, buf_len);
-	} else {
-		bytes_sent = udp_send_out(gc, buf, buf_len);
-	}
 
-	return bytes_sent;
+	sched = send_sched_get(qd);
+	send_sched_refill(sched);
+	if (g_queue_is_empty(sched->queue[send_class])
+			&& sched->tokens[send_class] >= QQ_SEND_TOKEN) {
+		sched->tokens[send_class] -= QQ_SEND_TOKEN;
+		return send_write(gc, fd, buf, buf_len);
+	}
+
+	/* out of budget, keep order inside the class */
+	pkt = g_new0(qq_send_packet, 1);
+	pkt->cmd = cmd;
+	pkt->seq = seq;
+	pkt->fd = fd;
+	pkt->len = buf_len;
+	pkt->buf = g_memdup(buf, buf_len);
+	g_queue_push_tail(sched->queue[send_class], pkt);
+	send_sched_queued_inc(sched, pkt);
+	if (sched->drain_timer == 0) {
+		sched->drain_timer = purple_timeout_add(QQ_SEND_TICK, send_sched_drain, gc);
+	}
+	return buf_len;
 }
 
-gint qq_send_cmd_encrypted(PurpleConnection *gc, guint16 cmd, guint16 seq,
+gint qq_send_cmd_encrypted_fd(PurpleConnection *gc, gint fd, guint16 cmd, guint16 seq,
 	guint8 *encrypted, gint encrypted_len, gboolean is_save2trans)
 {
 	gint sent_len;
@@ -1132,13 +1729,22 @@ gint qq_send_cmd_encrypted(PurpleConnection *gc, guint16 cmd, guint16 seq,
 				seq, qq_get_cmd_desc(cmd), cmd, encrypted_len);
 #endif
 
-	sent_len = packet_send_out(gc, cmd, seq, encrypted, encrypted_len);
+	sent_len = packet_send_out(gc, fd, send_class_get(gc->proto_data, cmd, 0),
+			cmd, seq, encrypted, encrypted_len);
 	if (is_save2trans)  {
-		qq_trans_add_client_cmd(gc, cmd, seq, encrypted, encrypted_len, 0, 0);
+		qq_trans_add_client_cmd(gc, fd, cmd, seq, encrypted, encrypted_len, 0, 0);
 	}
 	return sent_len;
 }
 
+gint qq_send_cmd_encrypted(PurpleConnection *gc, guint16 cmd, guint16 seq,
+	guint8 *encrypted, gint encrypted_len, gboolean is_save2trans)
+{
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, -1);
+	return qq_send_cmd_encrypted_fd(gc, ((qq_data *) gc->proto_data)->fd,
+			cmd, seq, encrypted, encrypted_len, is_save2trans);
+}
+
 /* Encrypt data with session_key, and send packet out */
 static gint send_cmd_detail(PurpleConnection *gc, guint16 cmd, guint16 seq,
 	guint8 *data, gint data_len, gboolean is_save2trans,
@@ -1148,6 +1754,7 @@ static gint send_cmd_detail(PurpleConnection *gc, guint16 cmd, guint16 seq,
 	guint8 *encrypted;
 	gint encrypted_len;
 	gint bytes_sent;
+	qq_cmd_stat *cs;
 
 	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, -1);
 	qd = (qq_data *)gc->proto_data;
@@ -1162,11 +1769,17 @@ static gint send_cmd_detail(PurpleConnection *gc, guint16 cmd, guint16 seq,
 		return -1;
 	}
 
-	bytes_sent = packet_send_out(gc, cmd, seq, encrypted, encrypted_len);
+	bytes_sent = packet_send_out(gc, qd->fd, send_class_get(qd, cmd, 0),
+			cmd, seq, encrypted, encrypted_len);
 
 	if (is_save2trans)  {
-		qq_trans_add_client_cmd(gc, cmd, seq, encrypted, encrypted_len,
+		qq_trans_add_client_cmd(gc, qd->fd, cmd, seq, encrypted, encrypted_len,
 				update_class, ship_value);
+	} else {
+		/* not tracked by transaction, count it here */
+		cs = qq_net_stat_get(qd, cmd, 0);
+		cs->sent++;
+		cs->bytes_out += encrypted_len;
 	}
 	return bytes_sent;
 }
@@ -1239,7 +1852,8 @@ gint qq_send_server_reply(PurpleConnection *gc, guint16 cmd, guint16 seq, guint8
 		return -1;
 	}
 
-	bytes_sent = packet_send_out(gc, cmd, seq, encrypted, encrypted_len);
+	/* ack server at once, or it sends again */
+	bytes_sent = packet_send_out(gc, qd->fd, QQ_SEND_INTERACTIVE, cmd, seq, encrypted, encrypted_len);
 	qq_trans_add_server_reply(gc, cmd, seq, encrypted, encrypted_len);
 
 	return bytes_sent;
@@ -1317,7 +1931,8 @@ static gint send_room_cmd(PurpleConnection *gc, guint8 room_cmd, guint32 room_id
 		return -1;
 	}
 
-	bytes_sent = packet_send_out(gc, QQ_CMD_ROOM, seq, encrypted, encrypted_len);
+	bytes_sent = packet_send_out(gc, qd->fd, send_class_get(qd, QQ_CMD_ROOM, room_cmd),
+			QQ_CMD_ROOM, seq, encrypted, encrypted_len);
 #if 1
 		/* qq_show_packet("send_room_cmd", buf, buf_len); */
 		purple_debug_info("QQ",
@@ -1330,6 +1945,16 @@ static gint send_room_cmd(PurpleConnection *gc, guint8 room_cmd, guint32 room_id
 	return bytes_sent;
 }
 
+/* resend room command, room_cmd decides its send class */
+gint qq_send_room_cmd_encrypted(PurpleConnection *gc, guint8 room_cmd, guint16 seq,
+		guint8 *encrypted, gint encrypted_len)
+{
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, -1);
+	return packet_send_out(gc, ((qq_data *) gc->proto_data)->fd,
+			send_class_get(gc->proto_data, QQ_CMD_ROOM, room_cmd),
+			QQ_CMD_ROOM, seq, encrypted, encrypted_len);
+}
+
 gint qq_send_room_cmd_mess(PurpleConnection *gc, guint8 room_cmd, guint32 room_id,
 		guint8 *data, gint data_len, guint32 update_class, guintptr ship_value)
 {
@@ -32,11 +32,21 @@
 
 #define QQ_CONNECT_STEPS    4	/* steps in connection */
 
+/* outgoing packets are paced per class, see send_budget in qq_network.c */
+enum {
+	QQ_SEND_INTERACTIVE = 0,	/* IM, typing and acks */
+	QQ_SEND_CONTROL,			/* login and keep alive */
+	QQ_SEND_BULK,				/* buddy and room sync */
+	QQ_SEND_CLASSES
+};
+
 gboolean qq_connect_later(gpointer data);
 void qq_disconnect(PurpleConnection *gc);
 
 gint qq_send_cmd_encrypted(PurpleConnection *gc, guint16 cmd, guint16 seq,
 		guint8 *encrypted_data, gint encrypted_len, gboolean is_save2trans);
+gint qq_send_cmd_encrypted_fd(PurpleConnection *gc, gint fd, guint16 cmd, guint16 seq,
+		guint8 *encrypted_data, gint encrypted_len, gboolean is_save2trans);
 gint qq_send_cmd(PurpleConnection *gc, guint16 cmd, guint8 *data, gint datalen);
 gint qq_send_cmd_mess(PurpleConnection *gc, guint16 cmd, guint8 *data, gint data_len,
 		guint32 update_class, guintptr ship_value);
@@ -51,4 +61,8 @@ gint qq_send_room_cmd_mess(PurpleConnection *gc, guint8 room_cmd, guint32 room_i
 gint qq_send_room_cmd_only(PurpleConnection *gc, guint8 room_cmd, guint32 room_id);
 gint qq_send_room_cmd_noid(PurpleConnection *gc, guint8 room_cmd,
 		guint8 *data, gint data_len);
+gint qq_send_room_cmd_encrypted(PurpleConnection *gc, guint8 room_cmd, guint16 seq,
+		guint8 *encrypted, gint encrypted_len);
+
+gboolean qq_send_is_queued(PurpleConnection *gc, guint16 cmd, guint16 seq);
 #endif
@@ -45,6 +45,7 @@
 #include "qq_process.h"
 #include "packet_parse.h"
 #include "qq_network.h"
+#include "qq_stat.h"
 #include "qq_trans.h"
 #include "utils.h"
 #include "buddy_memo.h"
@@ -471,11 +472,21 @@ void qq_proc_server_cmd(PurpleConnection *gc, guint16 cmd, guint16 seq, guint8 *
 
 	data = g_newa(guint8, rcved_len);
 	data_len = qq_decrypt(data, rcved, rcved_len, qd->session_key);
+	qq_proc_server_cmd_decrypted(gc, cmd, seq, rcved, rcved_len, data, data_len);
+}
+
+/* data is rcved decrypted by session key, data_len < 0 if failed */
+void qq_proc_server_cmd_decrypted(PurpleConnection *gc, guint16 cmd, guint16 seq,
+		guint8 *rcved, gint rcved_len, guint8 *data, gint data_len)
+{
+	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
+
 	if (data_len < 0) {
 		purple_debug_warning("QQ",
 			"Can not decrypt server cmd by session key, [%05d], 0x%04X %s, len %d\n",
 			seq, cmd, qq_get_cmd_desc(cmd), rcved_len);
 		qq_show_packet("Can not decrypted", rcved, rcved_len);
+		qq_net_stat_decrypt_fail(gc, cmd, 0);
 		return;
 	}
 
@@ -702,6 +713,22 @@ void qq_proc_room_cmds(PurpleConnection *gc, guint16 seq,
 	qq_data *qd;
 	guint8 *data;
 	gint data_len;
+
+	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *) gc->proto_data;
+
+	data = g_newa(guint8, rcved_len);
+	data_len = qq_decrypt(data, rcved, rcved_len, qd->session_key);
+	qq_proc_room_cmds_decrypted(gc, seq, room_cmd, room_id, rcved, rcved_len,
+			data, data_len, update_class, ship_value);
+}
+
+/* data is rcved decrypted by session key, data_len < 0 if failed */
+void qq_proc_room_cmds_decrypted(PurpleConnection *gc, guint16 seq,
+		guint8 room_cmd, guint32 room_id, guint8 *rcved, gint rcved_len,
+		guint8 *data, gint data_len, guint32 update_class, guintptr ship_value)
+{
+	qq_data *qd;
 	qq_room_data *rmd;
 	gint bytes;
 	guint8 reply_cmd, reply;
@@ -709,13 +736,12 @@ void qq_proc_room_cmds(PurpleConnection *gc, guint16 seq,
 	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
 	qd = (qq_data *) gc->proto_data;
 
-	data = g_newa(guint8, rcved_len);
-	data_len = qq_decrypt(data, rcved, rcved_len, qd->session_key);
 	if (data_len < 0) {
 		purple_debug_warning("QQ",
 			"Can not decrypt room cmd by session key, [%05d], 0x%02X %s for %d, len %d\n",
 			seq, room_cmd, qq_get_room_cmd_desc(room_cmd), room_id, rcved_len);
 		qq_show_packet("Can not decrypted", rcved, rcved_len);
+		qq_net_stat_decrypt_fail(gc, QQ_CMD_ROOM, room_cmd);
 		return;
 	}
 
@@ -898,12 +924,18 @@ guint8 qq_proc_login_cmds(PurpleConnection *gc,  guint16 cmd, guint16 seq,
 				"Can not decrypt login cmd, [%05d], 0x%04X %s, len %d\n",
 				seq, cmd, qq_get_cmd_desc(cmd), rcved_len);
 		qq_show_packet("Can not decrypted", rcved, rcved_len);
+		qq_net_stat_decrypt_fail(gc, cmd, 0);
 		purple_connection_error_reason(gc,
 				PURPLE_CONNECTION_ERROR_ENCRYPTION_ERROR,
 				_("Unable to decrypt login reply"));
 		return QQ_LOGIN_REPLY_ERR;
 	}
 
+	/* time of each step on login path, including our processing of previous one */
+	purple_debug_info("QQ", "Login step %s replied in %ld ms, %ld ms since start\n",
+			qq_get_cmd_desc(cmd), qq_elapsed_ms(&qd->ld.step_time), qq_elapsed_ms(&qd->ld.start_time));
+	g_get_current_time(&qd->ld.step_time);
+
 	switch (cmd) {
 		case QQ_CMD_TOUCH_SERVER:
 			ret_8 = qq_process_touch_server(gc, data, data_len);
@@ -959,33 +991,32 @@ guint8 qq_proc_login_cmds(PurpleConnection *gc,  guint16 cmd, guint16 seq,
 		case QQ_CMD_LOGIN:
 			ret_8 = qq_process_login(gc, data, data_len);
 			if ( ret_8 == QQ_TOUCH_REPLY_REDIRECT) {
-           		qq_request_touch_server(gc);
+           		qq_request_touch_server(gc, qd->fd);
 				return QQ_LOGIN_REPLY_OK;
            	}
 			if (ret_8 == QQ_LOGIN_REPLY_OK) {
-				qq_request_login_E9(gc);
+				qq_request_login_followups(gc);
 			} else {
 				return ret_8;
 			}
 
 			break;
 		case QQ_CMD_LOGIN_E9:
-			qq_request_login_EA(gc);
-			break;
 		case QQ_CMD_LOGIN_EA:
-			qq_request_login_getlist(gc, 0x0001);
+			/* sent together with list, nothing waits for them */
 			break;
 		case QQ_CMD_LOGIN_GETLIST:
 			ret_8 = qq_process_login_getlist(gc, data, data_len);
 			if (ret_8 == QQ_LOGIN_REPLY_OK)
 			{
-				qq_request_login_ED(gc);
+				qq_request_login_finish(gc);
 			}
 			break;
 		case QQ_CMD_LOGIN_EC:
 			break;
 		case QQ_CMD_LOGIN_ED:
-			qq_request_login_EC(gc);
+			qd->ld.login_ms = qq_elapsed_ms(&qd->ld.start_time);
+			purple_debug_info("QQ", "Login finished in %ld ms\n", qd->ld.login_ms);
 
 			purple_connection_update_progress(gc, _("Logging in"), QQ_CONNECT_STEPS - 1, QQ_CONNECT_STEPS);
 			purple_debug_info("QQ", "Login replies OK; everything is fine\n");
@@ -1012,23 +1043,38 @@ void qq_proc_client_cmds(PurpleConnection *gc, guint16 cmd, guint16 seq,
 	guint8 *data;
 	gint data_len;
 
+	g_return_if_fail(rcved_len > 0);
+
+	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *) gc->proto_data;
+
+	data = g_newa(guint8, rcved_len);
+	data_len = qq_decrypt(data, rcved, rcved_len, qd->session_key);
+	qq_proc_client_cmds_decrypted(gc, cmd, seq, rcved, rcved_len,
+			data, data_len, update_class, ship_value);
+}
+
+/* data is rcved decrypted by session key, data_len < 0 if failed */
+void qq_proc_client_cmds_decrypted(PurpleConnection *gc, guint16 cmd, guint16 seq,
+		guint8 *rcved, gint rcved_len, guint8 *data, gint data_len,
+		guint32 update_class, guintptr ship_value)
+{
+	qq_data *qd;
+
 	guint8 ret_8 = 0;
 	guint16 ret_16 = 0;
 	guint32 ret_32 = 0;
 	gboolean not_to_update = FALSE;
 
-	g_return_if_fail(rcved_len > 0);
-
 	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
 	qd = (qq_data *) gc->proto_data;
 
-	data = g_newa(guint8, rcved_len);
-	data_len = qq_decrypt(data, rcved, rcved_len, qd->session_key);
 	if (data_len < 0) {
 		purple_debug_warning("QQ",
 			"Reply can not be decrypted by session key, [%05d], 0x%04X %s, len %d\n",
 			seq, cmd, qq_get_cmd_desc(cmd), rcved_len);
 		qq_show_packet("Can not decrypted", rcved, rcved_len);
+		qq_net_stat_decrypt_fail(gc, cmd, 0);
 		return;
 	}
 
@@ -48,6 +48,16 @@ void qq_proc_room_cmds(PurpleConnection *gc, guint16 seq,
 
 void qq_proc_server_cmd(PurpleConnection *gc, guint16 cmd, guint16 seq, guint8 *rcved, gint rcved_len);
 
+/* same as above, but rcved has been decrypted into data, see qq_worker.c */
+void qq_proc_client_cmds_decrypted(PurpleConnection *gc, guint16 cmd, guint16 seq,
+		guint8 *rcved, gint rcved_len, guint8 *data, gint data_len,
+		guint32 update_class, guintptr ship_value);
+void qq_proc_room_cmds_decrypted(PurpleConnection *gc, guint16 seq,
+		guint8 room_cmd, guint32 room_id, guint8 *rcved, gint rcved_len,
+		guint8 *data, gint data_len, guint32 update_class, guintptr ship_value);
+void qq_proc_server_cmd_decrypted(PurpleConnection *gc, guint16 cmd, guint16 seq,
+		guint8 *rcved, gint rcved_len, guint8 *data, gint data_len);
+
 void qq_update_all(PurpleConnection *gc, guint16 cmd);
 void qq_update_online(PurpleConnection *gc, guint16 cmd);
 void qq_update_room(PurpleConnection *gc, guint8 room_cmd, guint32 room_id);
@@ -0,0 +1,273 @@
+/**
+ * @file qq_server.c
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "internal.h"
+
+#include "debug.h"
+#include "util.h"
+
+#include "qq_server.h"
+
+#define QQ_SERVER_UNKNOWN_MS	1000	/* assumed connect and touch time of new servers */
+#define QQ_SERVER_FAILS_MAX		8
+
+typedef struct _qq_server_score {
+	gchar *server;
+	glong connect_ms;		/* smoothed, 0 if unknown */
+	glong rtt_ms;			/* touch reply time, smoothed, 0 if unknown */
+	gint fails;				/* since last successful touch */
+	gchar *redirect;		/* where the server sent us last time */
+} qq_server_score;
+
+struct _qq_server_board {
+	gchar *filename;		/* in purple user dir */
+	GHashTable *scores;		/* server name to qq_server_score */
+	gchar *last_redirect;	/* points to a score->server */
+	gboolean is_changed;
+};
+
+static void score_free(qq_server_score *score)
+{
+	g_free(score->server);
+	g_free(score->redirect);
+	g_free(score);
+}
+
+static qq_server_score *score_get(qq_server_board *board, const gchar *server)
+{
+	qq_server_score *score;
+
+	score = g_hash_table_lookup(board->scores, server);
+	if (score == NULL) {
+		score = g_new0(qq_server_score, 1);
+		score->server = g_strdup(server);
+		g_hash_table_insert(board->scores, score->server, score);
+	}
+	return score;
+}
+
+/* keep 3/4 of history */
+static glong smooth(glong old, glong sample)
+{
+	if (sample < 0)	sample = 0;
+	return (old > 0) ? (old * 3 + sample) / 4 : sample;
+}
+
+/* file has one server per line: name, connect ms, rtt ms, fails, redirect.
+ * A line starting with "last_redirect" names the last redirect target */
+qq_server_board *qq_server_board_load(PurpleAccount *account)
+{
+	qq_server_board *board;
+	qq_server_score *score;
+	gchar *path;
+	gchar *contents = NULL;
+	gchar **lines;
+	gchar **fields;
+	gint i;
+
+	board = g_new0(qq_server_board, 1);
+	board->scores = g_hash_table_new_full(g_str_hash, g_str_equal,
+			NULL, (GDestroyNotify) score_free);
+	board->filename = g_strdup_printf("qq_servers_%s.txt",
+			purple_escape_filename(purple_account_get_username(account)));
+
+	path = g_build_filename(purple_user_dir(), board->filename, NULL);
+	if ( !g_file_get_contents(path, &contents, NULL, NULL)) {
+		g_free(path);
+		return board;
+	}
+	g_free(path);
+
+	lines = g_strsplit(contents, "\n", 0);
+	for (i = 0; lines[i] != NULL; i++) {
+		fields = g_strsplit(lines[i], "\t", 0);
+		if (fields[0] == NULL || fields[1] == NULL || *fields[1] == '\0') {
+			g_strfreev(fields);
+			continue;
+		}
+		if (strcmp(fields[0], "last_redirect") == 0) {
+			board->last_redirect = score_get(board, fields[1])->server;
+		} else if (g_strv_length(fields) >= 4) {
+			score = score_get(board, fields[0]);
+			score->connect_ms = atol(fields[1]);
+			score->rtt_ms = atol(fields[2]);
+			score->fails = atoi(fields[3]);
+			if (fields[4] != NULL && *fields[4] != '\0') {
+				score->redirect = g_strdup(fields[4]);
+			}
+		}
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+	g_free(contents);
+
+	purple_debug_info("QQ", "Load %d server scores\n", g_hash_table_size(board->scores));
+	return board;
+}
+
+static void score_to_line(gpointer key, gpointer value, gpointer data)
+{
+	qq_server_score *score = (qq_server_score *) value;
+
+	g_string_append_printf((GString *) data, "%s\t%ld\t%ld\t%d\t%s\n",
+			score->server, score->connect_ms, score->rtt_ms, score->fails,
+			score->redirect != NULL ? score->redirect : "");
+}
+
+void qq_server_board_save(qq_server_board *board)
+{
+	GString *str;
+
+	g_return_if_fail(board != NULL);
+	if ( !board->is_changed) {
+		return;
+	}
+
+	str = g_string_new("");
+	if (board->last_redirect != NULL) {
+		g_string_append_printf(str, "last_redirect\t%s\n", board->last_redirect);
+	}
+	g_hash_table_foreach(board->scores, score_to_line, str);
+
+	if (purple_util_write_data_to_file(board->filename, str->str, str->len)) {
+		board->is_changed = FALSE;
+	}
+	g_string_free(str, TRUE);
+}
+
+void qq_server_board_free(qq_server_board *board)
+{
+	if (board == NULL) {
+		return;
+	}
+	qq_server_board_save(board);
+	g_hash_table_destroy(board->scores);
+	g_free(board->filename);
+	g_free(board);
+}
+
+void qq_server_board_connected(qq_server_board *board, const gchar *server, glong connect_ms)
+{
+	qq_server_score *score;
+
+	g_return_if_fail(board != NULL && server != NULL);
+	score = score_get(board, server);
+	score->connect_ms = smooth(score->connect_ms, connect_ms);
+	board->is_changed = TRUE;
+}
+
+void qq_server_board_touched(qq_server_board *board, const gchar *server, glong rtt_ms)
+{
+	qq_server_score *score;
+
+	g_return_if_fail(board != NULL && server != NULL);
+	score = score_get(board, server);
+	score->rtt_ms = smooth(score->rtt_ms, rtt_ms);
+	score->fails = 0;
+	board->is_changed = TRUE;
+	purple_debug_info("QQ", "Server %s connect %ld ms, touch %ld ms\n",
+			server, score->connect_ms, score->rtt_ms);
+}
+
+void qq_server_board_failed(qq_server_board *board, const gchar *server)
+{
+	qq_server_score *score;
+
+	g_return_if_fail(board != NULL && server != NULL);
+	score = score_get(board, server);
+	if (score->fails < QQ_SERVER_FAILS_MAX)	score->fails++;
+	if (board->last_redirect == score->server) {
+		/* do not start with it again */
+		board->last_redirect = NULL;
+	}
+	board->is_changed = TRUE;
+}
+
+const gchar *qq_server_board_redirected(qq_server_board *board, const gchar *server, const gchar *target)
+{
+	qq_server_score *score;
+
+	g_return_val_if_fail(board != NULL && target != NULL, NULL);
+	if (server != NULL) {
+		score = score_get(board, server);
+		g_free(score->redirect);
+		score->redirect = g_strdup(target);
+	}
+
+	board->last_redirect = score_get(board, target)->server;
+	board->is_changed = TRUE;
+	return board->last_redirect;
+}
+
+const gchar *qq_server_board_last_redirect(qq_server_board *board)
+{
+	g_return_val_if_fail(board != NULL, NULL);
+	return board->last_redirect;
+}
+
+/* a server answered in est ms is picked with weight 1/(est + 50),
+ * halved by every failure since its last successful touch */
+static gdouble score_weight(qq_server_board *board, const gchar *server)
+{
+	qq_server_score *score;
+	glong est;
+
+	score = g_hash_table_lookup(board->scores, server);
+	if (score == NULL || score->rtt_ms <= 0) {
+		est = QQ_SERVER_UNKNOWN_MS;
+	} else {
+		est = score->connect_ms + score->rtt_ms;
+	}
+
+	return 1.0 / (est + 50) / (1 << ((score != NULL) ? score->fails : 0));
+}
+
+/* pick a server of servers not in picked, faster ones are more likely */
+gchar *qq_server_board_pick(qq_server_board *board, GList *servers, GSList *picked)
+{
+	GList *it;
+	gdouble total;
+	gdouble hit;
+	gchar *last = NULL;
+
+	g_return_val_if_fail(board != NULL, NULL);
+
+	total = 0;
+	for (it = servers; it != NULL; it = it->next) {
+		if (g_slist_find(picked, it->data) != NULL)	continue;
+		total += score_weight(board, it->data);
+	}
+	if (total <= 0) {
+		return NULL;
+	}
+
+	hit = total * rand() / (RAND_MAX + 1.0);
+	for (it = servers; it != NULL; it = it->next) {
+		if (g_slist_find(picked, it->data) != NULL)	continue;
+		last = it->data;
+		hit -= score_weight(board, it->data);
+		if (hit < 0)	break;
+	}
+	return last;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file qq_server.h
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _QQ_SERVER_H_
+#define _QQ_SERVER_H_
+
+#include <glib.h>
+#include "account.h"
+
+/* Per account scoreboard of login servers, kept in the purple user dir.
+ * Server names returned are owned by the board. */
+typedef struct _qq_server_board qq_server_board;
+
+qq_server_board *qq_server_board_load(PurpleAccount *account);
+void qq_server_board_save(qq_server_board *board);
+void qq_server_board_free(qq_server_board *board);
+
+void qq_server_board_connected(qq_server_board *board, const gchar *server, glong connect_ms);
+void qq_server_board_touched(qq_server_board *board, const gchar *server, glong rtt_ms);
+void qq_server_board_failed(qq_server_board *board, const gchar *server);
+const gchar *qq_server_board_redirected(qq_server_board *board, const gchar *server, const gchar *target);
+
+const gchar *qq_server_board_last_redirect(qq_server_board *board);
+gchar *qq_server_board_pick(qq_server_board *board, GList *servers, GSList *picked);
+
+#endif
@@ -0,0 +1,223 @@
+/**
+ * @file qq_stat.c
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "internal.h"
+
+#include "debug.h"
+
+#include "qq_define.h"
+#include "qq_stat.h"
+
+static const gulong rtt_bounds[QQ_STAT_RTT_BUCKETS - 1] = {
+	50, 100, 200, 500, 1000, 2000, 5000
+};
+
+#define STAT_KEY(cmd, room_cmd)	GUINT_TO_POINTER(((guint)(cmd) << 8) | (room_cmd))
+
+qq_cmd_stat *qq_net_stat_get(qq_data *qd, guint16 cmd, guint8 room_cmd)
+{
+	qq_cmd_stat *cs;
+
+	if (qd->net_stat.cmds == NULL) {
+		qd->net_stat.cmds = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	}
+
+	cs = g_hash_table_lookup(qd->net_stat.cmds, STAT_KEY(cmd, room_cmd));
+	if (cs == NULL) {
+		cs = g_new0(qq_cmd_stat, 1);
+		cs->cmd = cmd;
+		cs->room_cmd = room_cmd;
+		g_hash_table_insert(qd->net_stat.cmds, STAT_KEY(cmd, room_cmd), cs);
+	}
+	return cs;
+}
+
+glong qq_elapsed_ms(const GTimeVal *since)
+{
+	GTimeVal now;
+	glong ms;
+
+	g_get_current_time(&now);
+	ms = (now.tv_sec - since->tv_sec) * 1000 + (now.tv_usec - since->tv_usec) / 1000;
+	return (ms < 0) ? 0 : ms;	/* clock changed */
+}
+
+void qq_net_stat_add_rtt(qq_cmd_stat *cs, const GTimeVal *since)
+{
+	glong rtt;
+	gint i;
+
+	rtt = qq_elapsed_ms(since);
+
+	for (i = 0; i < QQ_STAT_RTT_BUCKETS - 1; i++) {
+		if ((gulong)rtt < rtt_bounds[i])	break;
+	}
+	cs->rtt_hist[i]++;
+	cs->rtt_count++;
+	cs->rtt_total += rtt;
+	if ((gulong)rtt > cs->rtt_max)	cs->rtt_max = rtt;
+}
+
+void qq_net_stat_decrypt_fail(PurpleConnection *gc, guint16 cmd, guint8 room_cmd)
+{
+	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
+	qq_net_stat_get((qq_data *)gc->proto_data, cmd, room_cmd)->decrypt_fail++;
+}
+
+void qq_net_stat_free(qq_data *qd)
+{
+	if (qd->net_stat.cmds != NULL) {
+		g_hash_table_destroy(qd->net_stat.cmds);
+		qd->net_stat.cmds = NULL;
+	}
+}
+
+static gint stat_cmp(gconstpointer a, gconstpointer b)
+{
+	const qq_cmd_stat *sa = a;
+	const qq_cmd_stat *sb = b;
+
+	if (sa->cmd != sb->cmd)	return sa->cmd - sb->cmd;
+	return sa->room_cmd - sb->room_cmd;
+}
+
+static void stat_list_add(gpointer key, gpointer value, gpointer list)
+{
+	*(GList **)list = g_list_prepend(*(GList **)list, value);
+}
+
+/* sorted by cmd and room_cmd, free with g_list_free */
+static GList *stat_list(qq_data *qd)
+{
+	GList *list = NULL;
+
+	if (qd->net_stat.cmds == NULL) {
+		return NULL;
+	}
+	g_hash_table_foreach(qd->net_stat.cmds, stat_list_add, &list);
+	return g_list_sort(list, stat_cmp);
+}
+
+static const gchar *stat_desc(const qq_cmd_stat *cs)
+{
+	if (cs->cmd == QQ_CMD_ROOM && cs->room_cmd != 0) {
+		return qq_get_room_cmd_desc(cs->room_cmd);
+	}
+	return qq_get_cmd_desc(cs->cmd);
+}
+
+gchar *qq_net_stat_to_html(qq_data *qd)
+{
+	GString *html;
+	GList *list, *it;
+	qq_cmd_stat *cs;
+	gint i;
+
+	html = g_string_new("<html><body>");
+	list = stat_list(qd);
+	if (list == NULL) {
+		g_string_append(html, _("No command has been sent or received yet"));
+	}
+
+	for (it = list; it != NULL; it = it->next) {
+		cs = (qq_cmd_stat *)it->data;
+		g_string_append_printf(html, "<b>%s</b> (0x%04X", stat_desc(cs), cs->cmd);
+		if (cs->room_cmd != 0) {
+			g_string_append_printf(html, "-0x%02X", cs->room_cmd);
+		}
+		g_string_append(html, ")<br>\n");
+
+		g_string_append_printf(html,
+				_("Sent %lu, Received %lu, Resend %lu, Lost %lu, Decrypt failed %lu<br>\n"),
+				cs->sent, cs->rcved, cs->resend, cs->lost, cs->decrypt_fail);
+		g_string_append_printf(html, _("Bytes out %" G_GUINT64_FORMAT ", in %" G_GUINT64_FORMAT "<br>\n"),
+				cs->bytes_out, cs->bytes_in);
+		if (cs->rtt_count == 0) {
+			continue;
+		}
+		g_string_append_printf(html, _("Reply time avg %lu ms, max %lu ms:"),
+				(gulong)(cs->rtt_total / cs->rtt_count), cs->rtt_max);
+		for (i = 0; i < QQ_STAT_RTT_BUCKETS; i++) {
+			if (i < QQ_STAT_RTT_BUCKETS - 1) {
+				g_string_append_printf(html, " &lt;%lu: %lu", rtt_bounds[i], cs->rtt_hist[i]);
+			} else {
+				g_string_append_printf(html, " more: %lu", cs->rtt_hist[i]);
+			}
+		}
+		g_string_append(html, "<br>\n");
+	}
+	g_list_free(list);
+
+	g_string_append(html, "</body></html>");
+	return g_string_free(html, FALSE);
+}
+
+gchar *qq_net_stat_to_json(qq_data *qd)
+{
+	GString *json;
+	GList *list, *it;
+	qq_cmd_stat *cs;
+	gint i;
+
+	json = g_string_new("{\n");
+	g_string_append_printf(json, "  \"uid\": %u,\n  \"time\": %lu,\n", qd->uid, (gulong)time(NULL));
+	g_string_append_printf(json, "  \"sent\": %lu, \"resend\": %lu, \"lost\": %lu, "
+			"\"rcved\": %lu, \"rcved_dup\": %lu,\n",
+			qd->net_stat.sent, qd->net_stat.resend, qd->net_stat.lost,
+			qd->net_stat.rcved, qd->net_stat.rcved_dup);
+	g_string_append_printf(json, "  \"keep_alive_itv\": %d, \"keep_alive_skipped\": %lu, "
+			"\"update_itv\": %d,\n",
+			qd->itv_effect.keep_alive * qd->itv_config.resend, qd->net_stat.keep_alive_skipped,
+			qd->itv_effect.update * qd->itv_config.resend);
+
+	g_string_append(json, "  \"rtt_bounds_ms\": [");
+	for (i = 0; i < QQ_STAT_RTT_BUCKETS - 1; i++) {
+		g_string_append_printf(json, i ? ", %lu" : "%lu", rtt_bounds[i]);
+	}
+	g_string_append(json, "],\n  \"cmds\": [");
+
+	list = stat_list(qd);
+	for (it = list; it != NULL; it = it->next) {
+		cs = (qq_cmd_stat *)it->data;
+		/* descriptions are plain identifiers, no need to escape */
+		g_string_append_printf(json, "%s\n    {\"cmd\": %u, \"room_cmd\": %u, \"name\": \"%s\", "
+				"\"sent\": %lu, \"rcved\": %lu, \"resend\": %lu, \"lost\": %lu, \"decrypt_fail\": %lu, "
+				"\"bytes_out\": %" G_GUINT64_FORMAT ", \"bytes_in\": %" G_GUINT64_FORMAT ", "
+				"\"rtt_count\": %lu, \"rtt_total_ms\": %" G_GUINT64_FORMAT ", \"rtt_max_ms\": %lu, "
+				"\"rtt_hist\": [",
+				it == list ? "" : ",",
+				cs->cmd, cs->room_cmd, stat_desc(cs),
+				cs->sent, cs->rcved, cs->resend, cs->lost, cs->decrypt_fail,
+				cs->bytes_out, cs->bytes_in,
+				cs->rtt_count, cs->rtt_total, cs->rtt_max);
+		for (i = 0; i < QQ_STAT_RTT_BUCKETS; i++) {
+			g_string_append_printf(json, i ? ", %lu" : "%lu", cs->rtt_hist[i]);
+		}
+		g_string_append(json, "]}");
+	}
+	g_list_free(list);
+
+	g_string_append(json, "\n  ]\n}\n");
+	return g_string_free(json, FALSE);
+}
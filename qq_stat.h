@@ -0,0 +1,62 @@
+/**
+ * @file qq_stat.h
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _QQ_STAT_H_
+#define _QQ_STAT_H_
+
+#include <glib.h>
+#include "qq.h"
+
+/* reply time buckets, in ms: <50 <100 <200 <500 <1000 <2000 <5000 and more */
+#define QQ_STAT_RTT_BUCKETS		8
+
+/* statistics of one command, room commands are counted per room_cmd */
+typedef struct _qq_cmd_stat {
+	guint16 cmd;
+	guint8 room_cmd;
+
+	gulong sent;			/* requests and commands sent, not counting resend */
+	gulong rcved;			/* replies and server commands, not counting dup */
+	gulong resend;
+	gulong lost;
+	gulong decrypt_fail;
+	guint64 bytes_out;		/* encrypted payload, including resend */
+	guint64 bytes_in;
+
+	gulong rtt_count;
+	guint64 rtt_total;		/* in ms */
+	gulong rtt_max;
+	gulong rtt_hist[QQ_STAT_RTT_BUCKETS];
+} qq_cmd_stat;
+
+qq_cmd_stat *qq_net_stat_get(qq_data *qd, guint16 cmd, guint8 room_cmd);
+glong qq_elapsed_ms(const GTimeVal *since);
+void qq_net_stat_add_rtt(qq_cmd_stat *cs, const GTimeVal *since);
+void qq_net_stat_decrypt_fail(PurpleConnection *gc, guint16 cmd, guint8 room_cmd);
+void qq_net_stat_free(qq_data *qd);
+
+gchar *qq_net_stat_to_html(qq_data *qd);
+gchar *qq_net_stat_to_json(qq_data *qd);
+
+#endif
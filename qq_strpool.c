@@ -0,0 +1,123 @@
+/**
+ * @file qq_strpool.c
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "internal.h"
+#include "debug.h"
+
+#include "qq_strpool.h"
+
+typedef struct _qq_str_entry qq_str_entry;
+struct _qq_str_entry {
+	qq_str_pool *pool;	/* NULL once the pool is freed */
+	gint ref;
+	gchar str[1];		/* allocated with the entry */
+};
+
+struct _qq_str_pool {
+	GHashTable *strings;	/* entry->str to entry, entries are not owned */
+};
+
+/* a handle always points to str of its entry */
+#define str_entry(istr) \
+	((qq_str_entry *)((gchar *)(istr) - G_STRUCT_OFFSET(qq_str_entry, str)))
+
+qq_str_pool *qq_str_pool_new(void)
+{
+	qq_str_pool *pool = g_new0(qq_str_pool, 1);
+	pool->strings = g_hash_table_new(g_str_hash, g_str_equal);
+	return pool;
+}
+
+static void str_entry_detach(gpointer key, gpointer value, gpointer user_data)
+{
+	((qq_str_entry *)value)->pool = NULL;
+}
+
+/* strings still referenced are detached and freed by their last qq_str_unref */
+void qq_str_pool_free(qq_str_pool *pool)
+{
+	g_return_if_fail(pool != NULL);
+
+	if (g_hash_table_size(pool->strings) > 0) {
+		purple_debug_info("QQ", "String pool has %d strings in use\n",
+				g_hash_table_size(pool->strings));
+	}
+	g_hash_table_foreach(pool->strings, str_entry_detach, NULL);
+	g_hash_table_destroy(pool->strings);
+	g_free(pool);
+}
+
+/* return a new reference to the interned copy of str */
+qq_str *qq_str_intern(qq_str_pool *pool, const gchar *str)
+{
+	qq_str_entry *entry;
+	gsize len;
+
+	g_return_val_if_fail(pool != NULL, NULL);
+	if (str == NULL) {
+		return NULL;
+	}
+
+	entry = g_hash_table_lookup(pool->strings, str);
+	if (entry != NULL) {
+		entry->ref++;
+		return entry->str;
+	}
+
+	len = strlen(str);
+	entry = g_malloc(G_STRUCT_OFFSET(qq_str_entry, str) + len + 1);
+	entry->pool = pool;
+	entry->ref = 1;
+	memcpy(entry->str, str, len + 1);
+	g_hash_table_insert(pool->strings, entry->str, entry);
+	return entry->str;
+}
+
+qq_str *qq_str_ref(qq_str *istr)
+{
+	if (istr != NULL) {
+		str_entry(istr)->ref++;
+	}
+	return istr;
+}
+
+void qq_str_unref(qq_str *istr)
+{
+	qq_str_entry *entry;
+
+	if (istr == NULL) {
+		return;
+	}
+
+	entry = str_entry(istr);
+	g_return_if_fail(entry->ref > 0);
+	if (--entry->ref > 0) {
+		return;
+	}
+
+	if (entry->pool != NULL) {
+		g_hash_table_remove(entry->pool->strings, entry->str);
+	}
+	g_free(entry);
+}
@@ -0,0 +1,44 @@
+/**
+ * @file qq_strpool.h
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _QQ_STRPOOL_H_
+#define _QQ_STRPOOL_H_
+
+#include <glib.h>
+
+/* Interned strings shared by buddies, room members and groups of one account.
+ * A qq_str * is an ordinary NUL terminated string and a stable handle:
+ * it stays valid until its last reference is dropped by qq_str_unref,
+ * even after the pool itself has been freed. Never g_free or modify it. */
+typedef const gchar qq_str;
+typedef struct _qq_str_pool qq_str_pool;
+
+qq_str_pool *qq_str_pool_new(void);
+void qq_str_pool_free(qq_str_pool *pool);
+
+qq_str *qq_str_intern(qq_str_pool *pool, const gchar *str);
+qq_str *qq_str_ref(qq_str *istr);
+void qq_str_unref(qq_str *istr);
+
+#endif
@@ -30,16 +30,95 @@
 #include "prefs.h"
 #include "request.h"
 
+#include "packet_parse.h"
+#include "qq_crypt.h"
 #include "qq_define.h"
 #include "qq_network.h"
 #include "qq_process.h"
+#include "qq_stat.h"
 #include "qq_trans.h"
+#include "qq_worker.h"
 
 enum {
-	QQ_TRANS_IS_SERVER = 0x01,			/* Is server command or client command */
-	QQ_TRANS_IS_IMPORT = 0x02,			/* Only notice if not get reply; or resend, disconn if reties get 0*/
-	QQ_TRANS_REMAINED = 0x04,				/* server command before login*/
-	QQ_TRANS_IS_REPLY = 0x08				/* server command before login*/
+	QQ_TRANS_IS_IMPORT = 0x02			/* Only notice if not get reply; or resend, disconn if reties get 0*/
+};
+
+#define QQ_TRANS_SLAB_LEN		32		/* transactions allocated at once */
+#define QQ_TRANS_BUF_CLASSES	3
+#define QQ_TRANS_BUF_CACHED		32		/* cached payloads per size class */
+#define QQ_REPLY_RATE			1		/* resent replies per second */
+#define QQ_REPLY_BURST			1
+#define QQ_REPLY_TOKEN			1000	/* one reply, tokens are in 1/1000 */
+#define QQ_SEQ_WINDOW			256		/* server seqs remembered per cmd, power of 2 */
+#define QQ_REMAIN_MAX			512		/* server cmds waiting for login */
+#define QQ_REMAIN_BATCH			32		/* processed in one main loop turn */
+
+/* most packets are less than 1K, bigger payloads are not pooled */
+static const gint trans_buf_sizes[QQ_TRANS_BUF_CLASSES] = { 128, 512, 1024 };
+
+typedef struct _qq_trans_buf qq_trans_buf;
+
+/* server seqs seen lately, bit (seq % QQ_SEQ_WINDOW) is set if seen */
+typedef struct _qq_seq_window {
+	guint16 top;		/* highest seq seen */
+	guint32 bits[QQ_SEQ_WINDOW / 32];
+} qq_seq_window;
+
+/* server cmd received before login, processed after it */
+typedef struct _qq_remain {
+	guint16 cmd;
+	guint16 seq;
+	gint order;				/* same for IMs of one sender */
+	qq_trans_buf *buf;		/* as received */
+	guint8 *data;			/* decrypted, NULL if not yet */
+	gint data_len;
+} qq_remain;
+
+/* server cmd seen lately and our reply to it, sent again if server did not get it.
+ * kept for two scans, as long as server transactions used to live */
+typedef struct _qq_reply_slot {
+	guint16 cmd;
+	guint16 seq;
+	qq_trans_buf *buf;		/* NULL if not replied yet */
+	gint scan_times;
+} qq_reply_slot;
+
+#define REPLY_KEY(cmd, seq)	GUINT_TO_POINTER(((guint)(cmd) << 16) | (seq))
+
+/* refcounted payload, shared by a transaction and its pending resends */
+struct _qq_trans_buf {
+	qq_trans_pool *pool;
+	qq_trans_buf *next;		/* link in free list */
+	gint ref;
+	gint size_class;		/* -1 if not pooled */
+	gint len;
+	guint8 data[1];
+};
+
+struct _qq_trans_pool {
+	gint ref;				/* owner and every payload in use */
+	gboolean is_closed;
+
+	GSList *slabs;
+	qq_transaction *free_trans;
+	qq_trans_buf *free_bufs[QQ_TRANS_BUF_CLASSES];
+	gint bufs_cached[QQ_TRANS_BUF_CLASSES];
+
+	/* duplicated server cmds are found by seq, payloads are not kept */
+	GHashTable *seq_windows;	/* cmd to qq_seq_window */
+	GHashTable *reply_store;	/* REPLY_KEY to qq_reply_slot */
+
+	/* server cmds before login, see qq_trans_process_remained */
+	GQueue *remains;
+	guint remain_timer;
+
+	/* replies resent to server, paced to prevent regard as spammer */
+	GQueue *replies;
+	gint reply_tokens;
+	GTimeVal reply_refill;
+	guint reply_timer;
+
+	qq_trans_pool_stat stat;
 };
 
 struct _qq_transaction {
@@ -50,10 +129,13 @@ struct _qq_transaction {
 	guint8 room_cmd;
 	guint32 room_id;
 
-	guint8 *data;
+	qq_trans_buf *buf;
+	guint8 *data;			/* point to buf->data */
 	gint data_len;
+	qq_transaction *next_free;
 
 	gint fd;
+	GTimeVal create_time;	/* for reply time statistics */
 	gint send_retries;
 	gint rcved_times;
 	gint scan_times;
@@ -63,21 +145,143 @@ struct _qq_transaction {
 };
 
 struct _qq_resend_data{
-	PurpleConnection *gc;
 	guint16 seq;
 	guint16 cmd;
-	guint8 *data;
-	gint data_len;
+	qq_trans_buf *buf;
 };
 
-gboolean qq_trans_is_server(qq_transaction *trans)
+static void reply_slot_free(qq_reply_slot *slot);
+
+static qq_trans_pool *trans_pool_get(qq_data *qd)
 {
-	g_return_val_if_fail(trans != NULL, FALSE);
+	if (qd->trans_pool == NULL) {
+		qd->trans_pool = g_new0(qq_trans_pool, 1);
+		qd->trans_pool->ref = 1;
+		qd->trans_pool->replies = g_queue_new();
+		qd->trans_pool->remains = g_queue_new();
+		qd->trans_pool->seq_windows = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				NULL, g_free);
+		qd->trans_pool->reply_store = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				NULL, (GDestroyNotify) reply_slot_free);
+		qd->trans_pool->reply_tokens = QQ_REPLY_BURST * QQ_REPLY_TOKEN;
+		g_get_current_time(&qd->trans_pool->reply_refill);
+	}
+	return qd->trans_pool;
+}
 
-	if (trans->flag & QQ_TRANS_IS_SERVER)
-		return TRUE;
-	else
-		return FALSE;
+static void trans_pool_unref(qq_trans_pool *pool)
+{
+	if (--pool->ref > 0) {
+		return;
+	}
+	g_queue_free(pool->replies);
+	g_queue_free(pool->remains);
+	g_hash_table_destroy(pool->seq_windows);
+	/* emptied by qq_trans_remove_all, slots hold payloads of this pool */
+	g_hash_table_destroy(pool->reply_store);
+	g_free(pool);
+}
+
+static qq_transaction *trans_alloc(qq_trans_pool *pool)
+{
+	qq_transaction *slab;
+	qq_transaction *trans;
+	gint i;
+
+	if (pool->free_trans == NULL) {
+		slab = g_new(qq_transaction, QQ_TRANS_SLAB_LEN);
+		for (i = 0; i < QQ_TRANS_SLAB_LEN; i++) {
+			slab[i].next_free = pool->free_trans;
+			pool->free_trans = &slab[i];
+		}
+		pool->slabs = g_slist_prepend(pool->slabs, slab);
+		pool->stat.slabs++;
+		pool->stat.trans_cached += QQ_TRANS_SLAB_LEN;
+	}
+
+	trans = pool->free_trans;
+	pool->free_trans = trans->next_free;
+	memset(trans, 0, sizeof(qq_transaction));
+
+	pool->stat.trans_cached--;
+	pool->stat.trans_used++;
+	return trans;
+}
+
+static void trans_release(qq_trans_pool *pool, qq_transaction *trans)
+{
+	trans->next_free = pool->free_trans;
+	pool->free_trans = trans;
+
+	pool->stat.trans_used--;
+	pool->stat.trans_cached++;
+}
+
+static qq_trans_buf *trans_buf_new(qq_trans_pool *pool, guint8 *data, gint data_len)
+{
+	qq_trans_buf *buf;
+	gint size_class;
+
+	for (size_class = 0; size_class < QQ_TRANS_BUF_CLASSES; size_class++) {
+		if (data_len <= trans_buf_sizes[size_class])	break;
+	}
+
+	if (size_class >= QQ_TRANS_BUF_CLASSES) {
+		buf = g_malloc(G_STRUCT_OFFSET(qq_trans_buf, data) + data_len);
+		buf->size_class = -1;
+		pool->stat.buf_bytes += data_len;
+	} else if (pool->free_bufs[size_class] != NULL) {
+		buf = pool->free_bufs[size_class];
+		pool->free_bufs[size_class] = buf->next;
+		pool->bufs_cached[size_class]--;
+		pool->stat.buf_cached--;
+	} else {
+		buf = g_malloc(G_STRUCT_OFFSET(qq_trans_buf, data) + trans_buf_sizes[size_class]);
+		buf->size_class = size_class;
+		pool->stat.buf_bytes += trans_buf_sizes[size_class];
+	}
+
+	buf->pool = pool;
+	buf->next = NULL;
+	buf->ref = 1;
+	buf->len = data_len;
+	/* don't use g_strdup, may have 0x00 */
+	memcpy(buf->data, data, data_len);
+
+	pool->ref++;
+	pool->stat.buf_used++;
+	return buf;
+}
+
+static qq_trans_buf *trans_buf_ref(qq_trans_buf *buf)
+{
+	buf->ref++;
+	return buf;
+}
+
+static void trans_buf_unref(qq_trans_buf *buf)
+{
+	qq_trans_pool *pool;
+	gint size_class;
+
+	if (buf == NULL || --buf->ref > 0) {
+		return;
+	}
+
+	pool = buf->pool;
+	size_class = buf->size_class;
+	pool->stat.buf_used--;
+	if (size_class >= 0 && !pool->is_closed
+			&& pool->bufs_cached[size_class] < QQ_TRANS_BUF_CACHED) {
+		buf->next = pool->free_bufs[size_class];
+		pool->free_bufs[size_class] = buf;
+		pool->bufs_cached[size_class]++;
+		pool->stat.buf_cached++;
+	} else {
+		pool->stat.buf_bytes -= (size_class >= 0) ? trans_buf_sizes[size_class] : buf->len;
+		g_free(buf);
+	}
+	trans_pool_unref(pool);
 }
 
 gboolean qq_trans_is_dup(qq_transaction *trans)
@@ -114,27 +318,35 @@ guint32 qq_trans_get_ship(qq_transaction *trans)
 	return trans->ship_value;
 }
 
+static void trans_set_data(qq_trans_pool *pool, qq_transaction *trans, guint8 *data, gint data_len)
+{
+	trans_buf_unref(trans->buf);
+	trans->buf = NULL;
+	trans->data = NULL;
+	trans->data_len = 0;
+	if (data != NULL && data_len > 0) {
+		trans->buf = trans_buf_new(pool, data, data_len);
+		trans->data = trans->buf->data;
+		trans->data_len = data_len;
+	}
+}
+
 static qq_transaction *trans_create(PurpleConnection *gc, gint fd,
 	guint16 cmd, guint16 seq, guint8 *data, gint data_len, guint32 update_class, guintptr ship_value)
 {
+	qq_trans_pool *pool;
 	qq_transaction *trans;
 
-	g_return_val_if_fail(gc != NULL, NULL);
-
-	trans = g_new0(qq_transaction, 1);
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, NULL);
+	pool = trans_pool_get((qq_data *) gc->proto_data);
 
-	memset(trans, 0, sizeof(qq_transaction));
+	/* trans is zeroed */
+	trans = trans_alloc(pool);
 	trans->fd = fd;
 	trans->cmd = cmd;
 	trans->seq = seq;
-
-	trans->data = NULL;
-	trans->data_len = 0;
-	if (data != NULL && data_len > 0) {
-		/* don't use g_strdup, may have 0x00 */
-		trans->data = g_memdup(data, data_len);
-		trans->data_len = data_len;
-	}
+	trans_set_data(pool, trans, data, data_len);
+	g_get_current_time(&trans->create_time);
 
 	trans->update_class = update_class;
 	trans->ship_value = ship_value;
@@ -159,9 +371,9 @@ static void trans_remove(PurpleConnection *gc, qq_transaction *trans)
 				trans->send_retries, trans->rcved_times, trans->scan_times,
 				qq_get_cmd_desc(trans->cmd));
 #endif
-	if (trans->data)	g_free(trans->data);
+	trans_buf_unref(trans->buf);
 	qd->transactions = g_list_remove(qd->transactions, trans);
-	g_free(trans);
+	trans_release(qd->trans_pool, trans);
 }
 
 static qq_transaction *trans_find(PurpleConnection *gc, guint16 cmd, guint16 seq)
@@ -185,11 +397,27 @@ static qq_transaction *trans_find(PurpleConnection *gc, guint16 cmd, guint16 seq
 	return NULL;
 }
 
-void qq_trans_add_client_cmd(PurpleConnection *gc,
+static qq_cmd_stat *trans_stat(qq_data *qd, qq_transaction *trans)
+{
+	return qq_net_stat_get(qd, trans->cmd, trans->room_cmd);
+}
+
+/* count a command just sent */
+static void trans_stat_add(qq_data *qd, qq_transaction *trans)
+{
+	qq_cmd_stat *cs = trans_stat(qd, trans);
+
+	cs->sent++;
+	cs->bytes_out += trans->data_len;
+}
+
+void qq_trans_add_client_cmd(PurpleConnection *gc, gint fd,
 	guint16 cmd, guint16 seq, guint8 *data, gint data_len, guint32 update_class, guintptr ship_value)
 {
 	qq_data *qd = (qq_data *)gc->proto_data;
-	qq_transaction *trans = trans_create(gc, qd->fd, cmd, seq, data, data_len, update_class, ship_value);
+	qq_transaction *trans = trans_create(gc, fd, cmd, seq, data, data_len, update_class, ship_value);
+
+	trans_stat_add(qd, trans);
 
 	if (cmd == QQ_CMD_LOGIN || cmd == QQ_CMD_KEEP_ALIVE) {
 		trans->flag |= QQ_TRANS_IS_IMPORT;
@@ -202,31 +430,104 @@ void qq_trans_add_client_cmd(PurpleConnection *gc,
 	qd->transactions = g_list_append(qd->transactions, trans);
 }
 
-static gboolean resend_timeout(gpointer data)
+static void reply_refill(qq_trans_pool *pool)
+{
+	glong elapsed;
+
+	elapsed = qq_elapsed_ms(&pool->reply_refill);
+	if (elapsed <= 0) {
+		return;
+	}
+	g_get_current_time(&pool->reply_refill);
+
+	if (elapsed > 60 * 1000) elapsed = 60 * 1000;
+	pool->reply_tokens += elapsed * QQ_REPLY_RATE;
+	if (pool->reply_tokens > QQ_REPLY_BURST * QQ_REPLY_TOKEN) {
+		pool->reply_tokens = QQ_REPLY_BURST * QQ_REPLY_TOKEN;
+	}
+}
+
+static void reply_queue_clear(qq_trans_pool *pool)
 {
 	qq_resend_data *rd;
+
+	if (pool->reply_timer > 0) {
+		purple_timeout_remove(pool->reply_timer);
+		pool->reply_timer = 0;
+	}
+	while ((rd = (qq_resend_data *) g_queue_pop_head(pool->replies)) != NULL) {
+		trans_buf_unref(rd->buf);
+		g_free(rd);
+	}
+}
+
+static gboolean reply_queue_drain(gpointer data)
+{
+	PurpleConnection *gc = (PurpleConnection *) data;
 	qq_data *qd;
+	qq_trans_pool *pool;
+	qq_resend_data *rd;
+
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, FALSE);
+	qd = (qq_data *) gc->proto_data;
+	pool = qd->trans_pool;
+	g_return_val_if_fail(pool != NULL, FALSE);
+
+	if (!PURPLE_CONNECTION_IS_CONNECTED(gc)) {
+		pool->reply_timer = 0;
+		reply_queue_clear(pool);
+		return FALSE;
+	}
+
+	reply_refill(pool);
+	while (pool->reply_tokens >= QQ_REPLY_TOKEN
+			&& (rd = (qq_resend_data *) g_queue_pop_head(pool->replies)) != NULL) {
+		pool->reply_tokens -= QQ_REPLY_TOKEN;
+		qq_send_cmd_encrypted(gc, rd->cmd, rd->seq, rd->buf->data, rd->buf->len, FALSE);
+		trans_buf_unref(rd->buf);
+		g_free(rd);
+	}
 
-	g_return_val_if_fail(data != NULL, FALSE);
-	rd = (qq_resend_data *)data;
+	if (g_queue_is_empty(pool->replies)) {
+		pool->reply_timer = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* queue reply of server command, one timer serves all of them */
+static void reply_queue_push(PurpleConnection *gc, guint16 cmd, guint16 seq, qq_trans_buf *buf)
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+	qq_trans_pool *pool = trans_pool_get(qd);
+	qq_resend_data *rd;
+	GList *it;
 
-	g_return_val_if_fail(rd->gc != NULL && PURPLE_CONNECTION_IS_CONNECTED(rd->gc)  && 
-		rd->gc->proto_data != NULL && rd->data != NULL, FALSE);
-	qq_send_cmd_encrypted(rd->gc, rd->cmd, rd->seq, rd->data, rd->data_len, FALSE);
+	/* server asks again before we resend, once is enough */
+	for (it = pool->replies->head; it != NULL; it = it->next) {
+		rd = (qq_resend_data *) it->data;
+		if (rd->cmd == cmd && rd->seq == seq) {
+			return;
+		}
+	}
 
-	qd = (qq_data *)rd->gc->proto_data;
-	qd->time2resend--;
+	rd = g_new0(qq_resend_data, 1);
+	rd->cmd = cmd;
+	rd->seq = seq;
+	rd->buf = trans_buf_ref(buf);
+	g_queue_push_tail(pool->replies, rd);
 
-	g_free(rd->data);
-	g_free(data);
-	return FALSE;		/* if return FALSE, timeout callback stops */
+	if (pool->reply_timer == 0) {
+		pool->reply_timer = purple_timeout_add(1000 / QQ_REPLY_RATE,
+				reply_queue_drain, gc);
+	}
 }
 
-qq_transaction *qq_trans_find_rcved(PurpleConnection *gc, guint16 cmd, guint16 seq)
+qq_transaction *qq_trans_find_rcved(PurpleConnection *gc, guint16 cmd, guint16 seq, gint rcved_len)
 {
 	qq_transaction *trans;
 	qq_data *qd;
-	qq_resend_data *rd;
+	qq_cmd_stat *cs;
 
 	qd = (qq_data *)gc->proto_data;
 
@@ -237,32 +538,158 @@ qq_transaction *qq_trans_find_rcved(PurpleConnection *gc, guint16 cmd, guint16 s
 
 	if (trans->rcved_times == 0) {
 		trans->scan_times = 0;
+		cs = trans_stat(qd, trans);
+		cs->rcved++;
+		cs->bytes_in += rcved_len;
+		qq_net_stat_add_rtt(cs, &trans->create_time);
 	}
 	trans->rcved_times++;
-	/* server may not get our confirm reply before, send reply again*/
-	if (qq_trans_is_server(trans) && (trans->flag & QQ_TRANS_IS_REPLY)) {
-		if (trans->data != NULL && trans->data_len > 0) {
-			purple_debug_warning("QQ", 
-				"Server hasn't received our ack, Send reply again.\n [%05d] %s(0x%04X), rawdata_len %d\n",
-				trans->seq, qq_get_cmd_desc(cmd), cmd, trans->data_len);
-			/* prevent regard as spammer */
-			if (trans->cmd == QQ_CMD_RECV_IM || trans->cmd == QQ_CMD_RECV_IM_CE)
-			{
-				rd = g_new0(qq_resend_data, 1);
-				rd->gc = gc;
-				rd->cmd = trans->cmd;
-				rd->seq = trans->seq;
-				rd->data = g_memdup(trans->data, trans->data_len);
-				rd->data_len = trans->data_len;
-				if (qd->time2resend) 
-					qd->time2resend++;
-				else 
-					qd->time2resend = 1;
-				g_timeout_add_seconds(qd->time2resend, resend_timeout, rd);
-			} else qq_send_cmd_encrypted(gc, trans->cmd, trans->seq, trans->data, trans->data_len, FALSE);
+	return trans;
+}
+
+/* return TRUE if seq is seen before, then it is marked as seen */
+static gboolean seq_window_check(qq_seq_window *win, guint16 seq)
+{
+	gint diff;
+	guint idx;
+
+	diff = (gint16)(seq - win->top);
+	if (diff > 0) {
+		/* slide forward, forget seqs falling out */
+		if (diff >= QQ_SEQ_WINDOW) {
+			memset(win->bits, 0, sizeof(win->bits));
+		} else {
+			while (win->top != seq) {
+				win->top++;
+				idx = win->top & (QQ_SEQ_WINDOW - 1);
+				win->bits[idx >> 5] &= ~(1u << (idx & 31));
+			}
 		}
+		win->top = seq;
+	} else if (-diff >= QQ_SEQ_WINDOW) {
+		/* far behind, server must have restarted its seq */
+		memset(win->bits, 0, sizeof(win->bits));
+		win->top = seq;
 	}
-	return trans;
+
+	idx = seq & (QQ_SEQ_WINDOW - 1);
+	if (win->bits[idx >> 5] & (1u << (idx & 31))) {
+		return TRUE;
+	}
+	win->bits[idx >> 5] |= (1u << (idx & 31));
+	return FALSE;
+}
+
+/* let server send it again, it is not processed */
+static void seq_window_forget(qq_trans_pool *pool, guint16 cmd, guint16 seq)
+{
+	qq_seq_window *win;
+	guint idx;
+
+	win = (qq_seq_window *) g_hash_table_lookup(pool->seq_windows, GUINT_TO_POINTER((guint) cmd));
+	if (win == NULL) {
+		return;
+	}
+	idx = seq & (QQ_SEQ_WINDOW - 1);
+	win->bits[idx >> 5] &= ~(1u << (idx & 31));
+}
+
+static void reply_slot_free(qq_reply_slot *slot)
+{
+	trans_buf_unref(slot->buf);
+	g_free(slot);
+}
+
+static qq_reply_slot *reply_store_find(qq_trans_pool *pool, guint16 cmd, guint16 seq)
+{
+	return (qq_reply_slot *) g_hash_table_lookup(pool->reply_store, REPLY_KEY(cmd, seq));
+}
+
+static qq_reply_slot *reply_store_add(qq_trans_pool *pool, guint16 cmd, guint16 seq)
+{
+	qq_reply_slot *slot;
+
+	slot = reply_store_find(pool, cmd, seq);
+	if (slot == NULL) {
+		slot = g_new0(qq_reply_slot, 1);
+		slot->cmd = cmd;
+		slot->seq = seq;
+		g_hash_table_insert(pool->reply_store, REPLY_KEY(cmd, seq), slot);
+	}
+	return slot;
+}
+
+static gboolean reply_slot_expire(gpointer key, gpointer value, gpointer data)
+{
+	qq_reply_slot *slot = (qq_reply_slot *) value;
+
+	slot->scan_times++;
+	if (slot->scan_times <= 1) {
+		return FALSE;
+	}
+	/* server may send it again as a new one, like an expired server transaction */
+	seq_window_forget((qq_trans_pool *) data, slot->cmd, slot->seq);
+	return TRUE;
+}
+
+static void reply_store_clear(qq_trans_pool *pool)
+{
+	g_hash_table_remove_all(pool->reply_store);
+}
+
+/* check server cmd against seqs seen before,
+ * if duplicated, server may not get our confirm reply before, send reply again */
+gboolean qq_trans_server_dup(PurpleConnection *gc, guint16 cmd, guint16 seq)
+{
+	qq_data *qd;
+	qq_trans_pool *pool;
+	qq_seq_window *win;
+	qq_reply_slot *slot;
+	qq_cmd_stat *cs;
+
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, FALSE);
+	qd = (qq_data *) gc->proto_data;
+	pool = trans_pool_get(qd);
+
+	win = (qq_seq_window *) g_hash_table_lookup(pool->seq_windows, GUINT_TO_POINTER((guint) cmd));
+	if (win == NULL) {
+		win = g_new0(qq_seq_window, 1);
+		win->top = seq;
+		g_hash_table_insert(pool->seq_windows, GUINT_TO_POINTER((guint) cmd), win);
+	}
+	if (!seq_window_check(win, seq)) {
+		reply_store_add(pool, cmd, seq);
+		return FALSE;
+	}
+
+	/* do not let the ack overtake replies still with the workers */
+	qq_worker_flush(gc);
+
+	slot = reply_store_find(pool, cmd, seq);
+	if (slot == NULL) {
+		/* marked by the window but not stored, never drop it unanswered */
+		reply_store_add(pool, cmd, seq);
+		return FALSE;
+	}
+	if (slot->buf == NULL) {
+		/* still waiting for login or being decrypted, reply is sent when processed */
+		purple_debug_info("QQ", "dup [%05d] %s is not processed yet\n", seq, qq_get_cmd_desc(cmd));
+		return TRUE;
+	}
+
+	cs = qq_net_stat_get(qd, cmd, 0);
+	cs->resend++;
+	cs->bytes_out += slot->buf->len;
+	purple_debug_warning("QQ",
+		"Server hasn't received our ack, Send reply again.\n [%05d] %s(0x%04X), rawdata_len %d\n",
+		seq, qq_get_cmd_desc(cmd), cmd, slot->buf->len);
+	/* prevent regard as spammer */
+	if (cmd == QQ_CMD_RECV_IM || cmd == QQ_CMD_RECV_IM_CE) {
+		reply_queue_push(gc, cmd, seq, slot->buf);
+	} else {
+		qq_send_cmd_encrypted(gc, cmd, seq, slot->buf->data, slot->buf->len, FALSE);
+	}
+	return TRUE;
 }
 
 void qq_trans_add_room_cmd(PurpleConnection *gc,
@@ -276,6 +703,7 @@ void qq_trans_add_room_cmd(PurpleConnection *gc,
 	trans->room_cmd = room_cmd;
 	trans->room_id = room_id;
 	trans->send_retries = qd->resend_times;
+	trans_stat_add(qd, trans);
 #if 0
 	purple_debug_info("QQ_TRANS", "Add room cmd, seq %d, data %p, len %d\n",
 		trans->seq, trans->data, trans->data_len);
@@ -283,95 +711,191 @@ void qq_trans_add_room_cmd(PurpleConnection *gc,
 	qd->transactions = g_list_append(qd->transactions, trans);
 }
 
+/* server cmd after login, only counted, qq_trans_server_dup has marked its seq */
 void qq_trans_add_server_cmd(PurpleConnection *gc, guint16 cmd, guint16 seq,
 		guint8 *rcved, gint rcved_len)
 {
 	qq_data *qd = (qq_data *)gc->proto_data;
-	qq_transaction *trans = trans_create(gc, qd->fd, cmd, seq, rcved, rcved_len, QQ_CMD_CLASS_NONE, 0);
+	qq_cmd_stat *cs;
 
-	trans->flag = QQ_TRANS_IS_SERVER;
-	trans->send_retries = 0;
-	trans->rcved_times = 1;
-#if 0
-	purple_debug_info("QQ_TRANS", "Add server cmd, seq %d, data %p, len %d\n",
-			trans->seq, trans->data, trans->data_len);
-#endif
-	qd->transactions = g_list_append(qd->transactions, trans);
+	cs = qq_net_stat_get(qd, cmd, 0);
+	cs->rcved++;
+	cs->bytes_in += rcved_len;
 }
 
 void qq_trans_add_server_reply(PurpleConnection *gc, guint16 cmd, guint16 seq,
 		guint8 *reply, gint reply_len)
 {
-	qq_transaction *trans;
+	qq_data *qd = (qq_data *)gc->proto_data;
+	qq_trans_pool *pool;
+	qq_reply_slot *slot;
 
 	g_return_if_fail(reply != NULL && reply_len > 0);
+	pool = trans_pool_get(qd);
 
-	trans = trans_find(gc, cmd, seq);
-	if (trans == NULL) {
+	/* keep our reply until the slot expires */
+	slot = reply_store_add(pool, cmd, seq);
+	trans_buf_unref(slot->buf);
+	slot->buf = trans_buf_new(pool, reply, reply_len);
+	qq_net_stat_get(qd, cmd, 0)->bytes_out += reply_len;
+}
+
+static void remain_free(qq_remain *rm)
+{
+	trans_buf_unref(rm->buf);
+	g_free(rm->data);
+	g_free(rm);
+}
+
+static void remain_queue_clear(qq_trans_pool *pool)
+{
+	qq_remain *rm;
+
+	if (pool->remain_timer > 0) {
+		purple_timeout_remove(pool->remain_timer);
+		pool->remain_timer = 0;
+	}
+	while ((rm = (qq_remain *) g_queue_pop_head(pool->remains)) != NULL) {
+		remain_free(rm);
+	}
+}
+
+static void remain_decrypt(qq_data *qd, qq_remain *rm)
+{
+	if (rm->data != NULL) {
 		return;
 	}
+	rm->data = g_malloc(rm->buf->len);
+	rm->data_len = qq_decrypt(rm->data, rm->buf->data, rm->buf->len, qd->session_key);
+}
 
-	g_return_if_fail(trans->flag & QQ_TRANS_IS_SERVER);
-	trans->flag |= QQ_TRANS_IS_REPLY;
+static gint remain_cmp(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	return ((qq_remain *) a)->order - ((qq_remain *) b)->order;
+}
 
-	if (trans->data)	g_free(trans->data);
+static gboolean remain_drain(gpointer data)
+{
+	PurpleConnection *gc = (PurpleConnection *) data;
+	qq_data *qd;
+	qq_trans_pool *pool;
+	qq_remain *rm;
+	gint count;
+
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, FALSE);
+	qd = (qq_data *) gc->proto_data;
+	pool = qd->trans_pool;
+	g_return_val_if_fail(pool != NULL, FALSE);
+
+	for (count = 0; count < QQ_REMAIN_BATCH; count++) {
+		rm = (qq_remain *) g_queue_pop_head(pool->remains);
+		if (rm == NULL) {
+			break;
+		}
+		remain_decrypt(qd, rm);
+		qq_proc_server_cmd_decrypted(gc, rm->cmd, rm->seq,
+				rm->buf->data, rm->buf->len, rm->data, rm->data_len);
+		remain_free(rm);
+
+		/* connection may be closed while processing */
+		if (gc->proto_data == NULL || qd->trans_pool != pool || pool->remain_timer == 0) {
+			return FALSE;
+		}
+	}
 
-	trans->data = g_memdup(reply, reply_len);
-	trans->data_len = reply_len;
+	if (g_queue_is_empty(pool->remains)) {
+		purple_debug_info("QQ_TRANS", "All server cmds remained are processed\n");
+		pool->remain_timer = 0;
+		return FALSE;
+	}
+	return TRUE;
 }
 
+/* server cmd before login, or while those are still processed */
 void qq_trans_add_remain(PurpleConnection *gc, guint16 cmd, guint16 seq,
 		guint8 *data, gint data_len)
 {
 	qq_data *qd = (qq_data *)gc->proto_data;
-	qq_transaction *trans = trans_create(gc, qd->fd, cmd, seq, data, data_len, QQ_CMD_CLASS_NONE, 0);
-
-	trans->flag = QQ_TRANS_IS_SERVER;
-	trans->flag |= QQ_TRANS_REMAINED;
-	trans->send_retries = 0;
-	trans->rcved_times = 1;
-#if 1
-	purple_debug_info("QQ_TRANS", "Add server cmd and remained, seq %d, data %p, len %d\n",
-			trans->seq, trans->data, trans->data_len);
-#endif
-	qd->transactions = g_list_append(qd->transactions, trans);
+	qq_trans_pool *pool;
+	qq_remain *rm;
+	qq_cmd_stat *cs;
+
+	g_return_if_fail(data != NULL && data_len > 0);
+	pool = trans_pool_get(qd);
+
+	if (g_queue_get_length(pool->remains) >= QQ_REMAIN_MAX) {
+		/* not acked, server will send it again */
+		purple_debug_warning("QQ_TRANS", "Too many server cmds remained, drop [%05d] %s\n",
+				seq, qq_get_cmd_desc(cmd));
+		seq_window_forget(pool, cmd, seq);
+		return;
+	}
+
+	rm = g_new0(qq_remain, 1);
+	rm->cmd = cmd;
+	rm->seq = seq;
+	rm->order = g_queue_get_length(pool->remains);
+	rm->buf = trans_buf_new(pool, data, data_len);
+	g_queue_push_tail(pool->remains, rm);
+
+	cs = qq_net_stat_get(qd, cmd, 0);
+	cs->rcved++;
+	cs->bytes_in += data_len;
 }
 
+gboolean qq_trans_has_remained(PurpleConnection *gc)
+{
+	qq_data *qd = (qq_data *)gc->proto_data;
+
+	g_return_val_if_fail(qd != NULL, FALSE);
+	return (qd->trans_pool != NULL && !g_queue_is_empty(qd->trans_pool->remains));
+}
+
+/* process server cmds received before login, in batches.
+ * IMs of one sender are moved together, keeping their order,
+ * so each conversation gets all its offline messages at once */
 void qq_trans_process_remained(PurpleConnection *gc)
 {
 	qq_data *qd = (qq_data *)gc->proto_data;
-	GList *curr;
-	GList *next;
-	qq_transaction *trans;
+	qq_trans_pool *pool;
+	GHashTable *senders;
+	GList *it;
+	qq_remain *rm;
+	guint32 uid_from;
+	gpointer order;
 
 	g_return_if_fail(qd != NULL);
+	pool = qd->trans_pool;
+	if (pool == NULL || g_queue_is_empty(pool->remains) || pool->remain_timer > 0) {
+		return;
+	}
 
-	next = qd->transactions;
-	while( (curr = next) ) {
-		next = curr->next;
-		trans = (qq_transaction *) (curr->data);
-#if 0
-		purple_debug_info("QQ_TRANS", "Scan [%d]\n", trans->seq);
-#endif
-		if ( !(trans->flag & QQ_TRANS_IS_SERVER) ) {
+	senders = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (it = pool->remains->head; it != NULL; it = it->next) {
+		rm = (qq_remain *) it->data;
+		if (rm->cmd != QQ_CMD_RECV_IM && rm->cmd != QQ_CMD_RECV_IM_CE) {
 			continue;
 		}
-		if ( !(trans->flag & QQ_TRANS_REMAINED) ) {
+		remain_decrypt(qd, rm);
+		if (rm->data_len < 4) {
 			continue;
 		}
-		/* set QQ_TRANS_REMAINED off */
-		trans->flag &= ~QQ_TRANS_REMAINED;
-
-#if 1
-		purple_debug_info("QQ_TRANS",
-				"Process server cmd remained, seq %d, data %p, len %d, send_retries %d\n",
-				trans->seq, trans->data, trans->data_len, trans->send_retries);
-#endif
-		qq_proc_server_cmd(gc, trans->cmd, trans->seq, trans->data, trans->data_len);
+		qq_get32(&uid_from, rm->data);
+		/* order of first IM from this sender */
+		if (g_hash_table_lookup_extended(senders, GUINT_TO_POINTER(uid_from), NULL, &order)) {
+			rm->order = GPOINTER_TO_INT(order);
+		} else {
+			g_hash_table_insert(senders, GUINT_TO_POINTER(uid_from), GINT_TO_POINTER(rm->order));
+		}
 	}
+	/* g_queue_sort is stable */
+	g_queue_sort(pool->remains, remain_cmp, NULL);
 
-	/* purple_debug_info("QQ_TRANS", "Scan finished\n"); */
-	return;
+	purple_debug_info("QQ_TRANS", "Process %d server cmds remained, IMs from %d senders\n",
+			g_queue_get_length(pool->remains), g_hash_table_size(senders));
+	g_hash_table_destroy(senders);
+
+	pool->remain_timer = purple_timeout_add(0, remain_drain, gc);
 }
 
 gboolean qq_trans_scan(PurpleConnection *gc)
@@ -380,6 +904,7 @@ gboolean qq_trans_scan(PurpleConnection *gc)
 	GList *curr;
 	GList *next;
 	qq_transaction *trans;
+	qq_cmd_stat *cs;
 
 	g_return_val_if_fail(qd != NULL, FALSE);
 
@@ -389,11 +914,6 @@ gboolean qq_trans_scan(PurpleConnection *gc)
 		trans = (qq_transaction *) (curr->data);
 		/* purple_debug_info("QQ_TRANS", "Scan [%d]\n", trans->seq); */
 
-		if (trans->flag & QQ_TRANS_REMAINED) {
-			/* keep server cmd before login*/
-			continue;
-		}
-
 		trans->scan_times++;
 		if (trans->scan_times <= 1) {
 			/* skip in 10 seconds */
@@ -406,7 +926,8 @@ gboolean qq_trans_scan(PurpleConnection *gc)
 			continue;
 		}
 
-		if (trans->flag & QQ_TRANS_IS_SERVER) {
+		/* not sent out yet, do not count it */
+		if (qq_send_is_queued(gc, trans->cmd, trans->seq)) {
 			continue;
 		}
 
@@ -421,6 +942,7 @@ gboolean qq_trans_scan(PurpleConnection *gc)
 			}
 
 			qd->net_stat.lost++;
+			trans_stat(qd, trans)->lost++;
 			purple_debug_error("QQ_TRANS",
 				"Lost [%d] %s, data %p, len %d, retries %d\n",
 				trans->seq, qq_get_cmd_desc(trans->cmd),
@@ -430,18 +952,52 @@ gboolean qq_trans_scan(PurpleConnection *gc)
 		}
 
 		qd->net_stat.resend++;
+		cs = trans_stat(qd, trans);
+		cs->resend++;
+		cs->bytes_out += trans->data_len;
 		purple_debug_warning("QQ_TRANS",
 				"Resend [%d] %s data %p, len %d, send_retries %d\n",
 				trans->seq, qq_get_cmd_desc(trans->cmd),
 				trans->data, trans->data_len, trans->send_retries);
 
-		qq_send_cmd_encrypted(gc, trans->cmd, trans->seq, trans->data, trans->data_len, FALSE);
+		if (trans->cmd == QQ_CMD_ROOM) {
+			qq_send_room_cmd_encrypted(gc, trans->room_cmd, trans->seq, trans->data, trans->data_len);
+		} else {
+			/* touch of a racer goes back to its own server */
+			qq_send_cmd_encrypted_fd(gc, trans->fd, trans->cmd, trans->seq,
+					trans->data, trans->data_len, FALSE);
+		}
+	}
+
+	/* server cmds before login are kept until processed */
+	if (qd->is_login && qd->trans_pool != NULL) {
+		g_hash_table_foreach_remove(qd->trans_pool->reply_store, reply_slot_expire, qd->trans_pool);
 	}
 
 	/* purple_debug_info("QQ_TRANS", "Scan finished\n"); */
 	return FALSE;
 }
 
+/* drop transactions of a closed connection, they must not be resent on others */
+void qq_trans_remove_fd(PurpleConnection *gc, gint fd)
+{
+	qq_data *qd = (qq_data *)gc->proto_data;
+	GList *curr;
+	GList *next;
+	qq_transaction *trans;
+
+	g_return_if_fail(qd != NULL);
+
+	next = qd->transactions;
+	while( (curr = next) ) {
+		next = curr->next;
+		trans = (qq_transaction *) (curr->data);
+		if (trans->fd == fd) {
+			trans_remove(gc, trans);
+		}
+	}
+}
+
 /* clean up send trans and free all contents */
 void qq_trans_remove_all(PurpleConnection *gc)
 {
@@ -449,12 +1005,20 @@ void qq_trans_remove_all(PurpleConnection *gc)
 	qq_transaction *trans;
 	gint count = 0;
 
+	if (qd->trans_pool != NULL) {
+		reply_queue_clear(qd->trans_pool);
+		reply_store_clear(qd->trans_pool);
+		remain_queue_clear(qd->trans_pool);
+		/* seqs start again on next login */
+		g_hash_table_remove_all(qd->trans_pool->seq_windows);
+	}
+
 	while(qd->transactions != NULL) {
 		trans = (qq_transaction *) (qd->transactions->data);
 		qd->transactions = g_list_remove(qd->transactions, trans);
 
-		if (trans->data)	g_free(trans->data);
-		g_free(trans);
+		trans_buf_unref(trans->buf);
+		trans_release(qd->trans_pool, trans);
 
 		count++;
 	}
@@ -462,3 +1026,48 @@ void qq_trans_remove_all(PurpleConnection *gc)
 		purple_debug_info("QQ_TRANS", "Free all %d packets\n", count);
 	}
 }
+
+void qq_trans_get_pool_stat(PurpleConnection *gc, qq_trans_pool_stat *stat)
+{
+	qq_data *qd = (qq_data *)gc->proto_data;
+
+	g_return_if_fail(qd != NULL && stat != NULL);
+
+	if (qd->trans_pool == NULL) {
+		memset(stat, 0, sizeof(qq_trans_pool_stat));
+		return;
+	}
+	*stat = qd->trans_pool->stat;
+}
+
+/* called when closing, payloads still in use are freed by their last unref */
+void qq_trans_pool_free(PurpleConnection *gc)
+{
+	qq_data *qd = (qq_data *)gc->proto_data;
+	qq_trans_pool *pool;
+	qq_trans_buf *buf;
+	gint i;
+
+	g_return_if_fail(qd != NULL);
+	if ((pool = qd->trans_pool) == NULL) {
+		return;
+	}
+	qd->trans_pool = NULL;
+
+	/* all transactions have been released by qq_trans_remove_all */
+	g_return_if_fail(pool->stat.trans_used == 0);
+	while (pool->slabs != NULL) {
+		g_free(pool->slabs->data);
+		pool->slabs = g_slist_delete_link(pool->slabs, pool->slabs);
+	}
+
+	for (i = 0; i < QQ_TRANS_BUF_CLASSES; i++) {
+		while ((buf = pool->free_bufs[i]) != NULL) {
+			pool->free_bufs[i] = buf->next;
+			g_free(buf);
+		}
+	}
+
+	pool->is_closed = TRUE;
+	trans_pool_unref(pool);
+}
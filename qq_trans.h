@@ -31,15 +31,25 @@
 typedef struct _qq_transaction qq_transaction;
 typedef struct _qq_resend_data qq_resend_data;
 
-qq_transaction *qq_trans_find_rcved(PurpleConnection *gc, guint16 cmd, guint16 seq);
-gboolean qq_trans_is_server(qq_transaction *trans) ;
+/* occupancy of qq_data->trans_pool */
+typedef struct _qq_trans_pool_stat {
+	gint slabs;
+	gint trans_used;
+	gint trans_cached;
+	gint buf_used;
+	gint buf_cached;
+	gsize buf_bytes;		/* held by used and cached payloads */
+} qq_trans_pool_stat;
+
+qq_transaction *qq_trans_find_rcved(PurpleConnection *gc, guint16 cmd, guint16 seq, gint rcved_len);
+gboolean qq_trans_server_dup(PurpleConnection *gc, guint16 cmd, guint16 seq);
 gboolean qq_trans_is_dup(qq_transaction *trans);
 guint8 qq_trans_get_room_cmd(qq_transaction *trans);
 guint32 qq_trans_get_room_id(qq_transaction *trans);
 guint32 qq_trans_get_class(qq_transaction *trans);
 guint32 qq_trans_get_ship(qq_transaction *trans);
 
-void qq_trans_add_client_cmd(PurpleConnection *gc, guint16 cmd, guint16 seq,
+void qq_trans_add_client_cmd(PurpleConnection *gc, gint fd, guint16 cmd, guint16 seq,
 		guint8 *data, gint data_len, guint32 update_class, guintptr ship_value);
 void qq_trans_add_room_cmd(PurpleConnection *gc,
 		guint16 seq, guint8 room_cmd, guint32 room_id,
@@ -51,8 +61,13 @@ void qq_trans_add_server_reply(PurpleConnection *gc, guint16 cmd, guint16 seq,
 void qq_trans_add_remain(PurpleConnection *gc, guint16 cmd, guint16 seq,
 	guint8 *data, gint data_len);
 
+gboolean qq_trans_has_remained(PurpleConnection *gc);
 void qq_trans_process_remained(PurpleConnection *gc);
 gboolean qq_trans_scan(PurpleConnection *gc);
+void qq_trans_remove_fd(PurpleConnection *gc, gint fd);
 void qq_trans_remove_all(PurpleConnection *gc);
 
+void qq_trans_get_pool_stat(PurpleConnection *gc, qq_trans_pool_stat *stat);
+void qq_trans_pool_free(PurpleConnection *gc);
+
 #endif
@@ -0,0 +1,292 @@
+/**
+ * @file qq_worker.c
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "internal.h"
+
+#include "debug.h"
+
+#include "qq.h"
+#include "qq_crypt.h"
+#include "qq_process.h"
+#include "qq_worker.h"
+
+/* Only decryption runs in worker threads. Processing the reply touches
+ * qq_data and libpurple everywhere, so it is done in the main loop,
+ * strictly in the order the packets arrived. */
+
+typedef struct _qq_worker_job {
+	guint ticket;
+	gint kind;
+	guint16 cmd;
+	guint16 seq;
+	guint8 room_cmd;
+	guint32 room_id;
+	guint32 update_class;
+	guintptr ship_value;
+	guint8 key[QQ_KEY_LENGTH];
+
+	guint8 *rcved;
+	gint rcved_len;
+	guint8 *data;
+	gint data_len;
+} qq_worker_job;
+
+struct _qq_worker {
+	PurpleConnection *gc;	/* NULL once stopped */
+	gint ref;				/* owner and each job not yet delivered */
+	gint stopped;			/* set by qq_worker_stop, workers skip decrypting */
+	GThreadPool *pool;
+	GAsyncQueue *done;		/* decrypted, from workers to main loop */
+
+	/* main loop only */
+	guint next_push;
+	guint next_deliver;
+	GList *held;			/* done out of order, sorted by ticket */
+};
+
+static void job_free(qq_worker_job *job)
+{
+	g_free(job->rcved);
+	g_free(job->data);
+	g_free(job);
+}
+
+static gint job_cmp(gconstpointer a, gconstpointer b)
+{
+	/* tickets may wrap */
+	return (gint)(((qq_worker_job *)a)->ticket - ((qq_worker_job *)b)->ticket);
+}
+
+static void worker_unref(qq_worker *w)
+{
+	qq_worker_job *job;
+
+	if (!g_atomic_int_dec_and_test(&w->ref)) {
+		return;
+	}
+
+	while ((job = g_async_queue_try_pop(w->done)) != NULL) {
+		job_free(job);
+	}
+	g_async_queue_unref(w->done);
+	while (w->held != NULL) {
+		job_free(w->held->data);
+		w->held = g_list_delete_link(w->held, w->held);
+	}
+	g_free(w);
+}
+
+static void job_process(PurpleConnection *gc, qq_worker_job *job)
+{
+	switch (job->kind) {
+		case QQ_WORKER_SERVER_CMD:
+			qq_proc_server_cmd_decrypted(gc, job->cmd, job->seq,
+					job->rcved, job->rcved_len, job->data, job->data_len);
+			break;
+		case QQ_WORKER_ROOM_CMD:
+			qq_proc_room_cmds_decrypted(gc, job->seq, job->room_cmd, job->room_id,
+					job->rcved, job->rcved_len, job->data, job->data_len,
+					job->update_class, job->ship_value);
+			break;
+		default:
+			qq_proc_client_cmds_decrypted(gc, job->cmd, job->seq,
+					job->rcved, job->rcved_len, job->data, job->data_len,
+					job->update_class, job->ship_value);
+			break;
+	}
+}
+
+/* main loop, process held jobs as long as they are in ticket order */
+static void worker_deliver_held(qq_worker *w)
+{
+	qq_worker_job *job;
+
+	while (w->held != NULL) {
+		job = (qq_worker_job *) w->held->data;
+		if (job->ticket != w->next_deliver) {
+			break;		/* wait for the one before it */
+		}
+		w->held = g_list_delete_link(w->held, w->held);
+		w->next_deliver++;
+
+		if (w->gc != NULL && w->gc->proto_data != NULL) {
+			job_process(w->gc, job);
+		}
+		job_free(job);
+	}
+}
+
+/* main loop */
+static gboolean worker_deliver(gpointer data)
+{
+	qq_worker *w = (qq_worker *) data;
+	qq_worker_job *job;
+
+	while ((job = g_async_queue_try_pop(w->done)) != NULL) {
+		w->held = g_list_insert_sorted(w->held, job, job_cmp);
+	}
+	worker_deliver_held(w);
+
+	worker_unref(w);
+	return FALSE;
+}
+
+/* worker thread, do not touch gc here */
+static void worker_run(gpointer data, gpointer user_data)
+{
+	qq_worker_job *job = (qq_worker_job *) data;
+	qq_worker *w = (qq_worker *) user_data;
+
+	if (!g_atomic_int_get(&w->stopped)) {
+		job->data_len = qq_decrypt(job->data, job->rcved, job->rcved_len, job->key);
+	}
+
+	/* the ref taken in qq_worker_push goes to worker_deliver */
+	g_async_queue_push(w->done, job);
+	g_idle_add(worker_deliver, w);
+}
+
+static qq_worker *worker_new(PurpleConnection *gc, gint threads)
+{
+	qq_worker *w;
+	GError *error = NULL;
+
+#if !GLIB_CHECK_VERSION(2,32,0)
+	if (!g_thread_supported()) {
+		g_thread_init(NULL);
+	}
+#endif
+
+	w = g_new0(qq_worker, 1);
+	w->gc = gc;
+	w->ref = 1;
+	w->done = g_async_queue_new();
+	w->pool = g_thread_pool_new(worker_run, w, threads, FALSE, &error);
+	if (w->pool == NULL) {
+		purple_debug_error("QQ", "Failed to start %d worker threads: %s\n",
+				threads, error != NULL ? error->message : "unknown");
+		if (error != NULL) g_error_free(error);
+		worker_unref(w);
+		return NULL;
+	}
+
+	purple_debug_info("QQ", "Started %d worker threads\n", threads);
+	return w;
+}
+
+gboolean qq_worker_push(PurpleConnection *gc, gint kind, guint16 cmd, guint16 seq,
+		guint8 room_cmd, guint32 room_id, guint8 *rcved, gint rcved_len,
+		guint32 update_class, guintptr ship_value)
+{
+	qq_data *qd;
+	qq_worker_job *job;
+
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, FALSE);
+	g_return_val_if_fail(rcved != NULL && rcved_len > 0, FALSE);
+	qd = (qq_data *) gc->proto_data;
+
+	if (qd->worker_threads <= 0) {
+		return FALSE;
+	}
+	if (qd->worker == NULL) {
+		qd->worker = worker_new(gc, qd->worker_threads);
+		if (qd->worker == NULL) {
+			qd->worker_threads = 0;		/* do not try again */
+			return FALSE;
+		}
+	}
+
+	job = g_new0(qq_worker_job, 1);
+	job->ticket = qd->worker->next_push++;
+	job->kind = kind;
+	job->cmd = cmd;
+	job->seq = seq;
+	job->room_cmd = room_cmd;
+	job->room_id = room_id;
+	job->update_class = update_class;
+	job->ship_value = ship_value;
+	memcpy(job->key, qd->session_key, sizeof(job->key));
+	job->rcved = g_memdup(rcved, rcved_len);
+	job->rcved_len = rcved_len;
+	job->data = g_malloc(rcved_len);
+	job->data_len = -1;
+
+	g_atomic_int_inc(&qd->worker->ref);
+	g_thread_pool_push(qd->worker->pool, job, NULL);
+	return TRUE;
+}
+
+/* Deliver every job pushed so far, in ticket order, before the caller
+ * handles a reply by itself on the main loop.
+ * Blocks only for the decryption of jobs already in flight */
+void qq_worker_flush(PurpleConnection *gc)
+{
+	qq_data *qd;
+	qq_worker *w;
+	qq_worker_job *job;
+
+	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *) gc->proto_data;
+
+	w = qd->worker;
+	if (w == NULL) {
+		return;
+	}
+
+	/* a job may disconnect and stop the worker under us */
+	g_atomic_int_inc(&w->ref);
+	while (w->gc != NULL && w->next_deliver != w->next_push) {
+		while (w->held == NULL
+				|| ((qq_worker_job *) w->held->data)->ticket != w->next_deliver) {
+			job = g_async_queue_pop(w->done);
+			w->held = g_list_insert_sorted(w->held, job, job_cmp);
+		}
+		worker_deliver_held(w);
+	}
+	worker_unref(w);
+}
+
+void qq_worker_stop(PurpleConnection *gc)
+{
+	qq_data *qd;
+	qq_worker *w;
+
+	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *) gc->proto_data;
+
+	w = qd->worker;
+	if (w == NULL) {
+		return;
+	}
+	qd->worker = NULL;
+
+	/* Do not wait for the queue here. Jobs not started yet are skipped
+	 * by the workers, and every job is still handed to worker_deliver,
+	 * which drops it and frees it with the last ref */
+	w->gc = NULL;
+	g_atomic_int_set(&w->stopped, 1);
+	g_thread_pool_free(w->pool, FALSE, FALSE);
+	w->pool = NULL;
+	worker_unref(w);
+}
@@ -0,0 +1,52 @@
+/**
+ * @file qq_worker.h
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _QQ_WORKER_H_
+#define _QQ_WORKER_H_
+
+#include <glib.h>
+#include "connection.h"
+
+/* which qq_proc_*_decrypted a job is handed to */
+enum {
+	QQ_WORKER_SERVER_CMD = 0,
+	QQ_WORKER_ROOM_CMD,
+	QQ_WORKER_CLIENT_CMD
+};
+
+/* decrypt rcved in a worker thread, the reply is processed later in the main
+ * loop, in the same order as pushed.
+ * return FALSE if worker threads are disabled, caller should process it now */
+gboolean qq_worker_push(PurpleConnection *gc, gint kind, guint16 cmd, guint16 seq,
+		guint8 room_cmd, guint32 room_id, guint8 *rcved, gint rcved_len,
+		guint32 update_class, guintptr ship_value);
+
+/* process all pushed jobs now, call it before handling a reply
+ * in the main loop while later replies may still be with the workers */
+void qq_worker_flush(PurpleConnection *gc);
+
+/* drop all pending jobs, called when disconnected */
+void qq_worker_stop(PurpleConnection *gc);
+
+#endif
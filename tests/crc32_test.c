@@ -0,0 +1,124 @@
+/**
+ * @file crc32_test.c
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define TEST_ROUNDS		10000
+#define TEST_LEN_MAX	4096
+#define TEST_ALIGN_MAX	16
+
+/* byte-wise crc32 as it was in qq_base.c, the reference for qq_crc32 */
+static guint32 crc32_table[256];
+static int crc32_initialized = 0;
+
+static void crc32_make_table(void)
+{
+	guint32 h = 1;
+	unsigned int i, j;
+
+	memset(crc32_table, 0, sizeof(crc32_table));
+
+	for (i = 128; i; i >>= 1) {
+		h = (h >> 1) ^ ((h & 1) ? 0xedb88320L : 0);
+
+		for (j = 0; j < 256; j += 2 * i)
+			crc32_table[i + j] = crc32_table[j] ^ h;
+	}
+
+	crc32_initialized = 1;
+}
+
+static guint32 crc32_old(guint32 crc, const guint8 *buf, int len)
+{
+	if (!crc32_initialized)
+		crc32_make_table();
+
+	if (!buf || len < 0)
+		return crc;
+
+	crc ^= 0xffffffffL;
+
+	while (len--)
+		crc = (crc >> 8) ^ crc32_table[(crc ^ *buf++) & 0xff];
+
+	return crc ^ 0xffffffffL;
+}
+
+int main(int argc, char *argv[])
+{
+	guint8 buf[TEST_LEN_MAX + TEST_ALIGN_MAX];
+	GRand *rand;
+	guint32 crc, expect, got;
+	gint round, len, align, i;
+	gint failed = 0;
+
+	got = qq_crc32(0, (const guint8 *) "123456789", 9);
+	if (got != 0xcbf43926) {
+		fprintf(stderr, "check value is 0x%08x, should be 0xcbf43926\n", got);
+		failed++;
+	}
+
+	/* fixed seed, a failure can be reproduced */
+	rand = g_rand_new_with_seed(0x20100520);
+	for (round = 0; round < TEST_ROUNDS; round++) {
+		len = g_rand_int_range(rand, 0, TEST_LEN_MAX + 1);
+		align = g_rand_int_range(rand, 0, TEST_ALIGN_MAX);
+		crc = g_rand_int(rand);
+		for (i = 0; i < len; i++) {
+			buf[align + i] = (guint8) g_rand_int(rand);
+		}
+
+		expect = crc32_old(crc, buf + align, len);
+		got = qq_crc32(crc, buf + align, len);
+		if (got != expect) {
+			fprintf(stderr, "round %d, crc 0x%08x, len %d, align %d: 0x%08x, should be 0x%08x\n",
+					round, crc, len, align, got, expect);
+			failed++;
+		}
+	}
+	g_rand_free(rand);
+
+	/* continue over two calls with the same result as one */
+	for (i = 0; i < TEST_LEN_MAX; i++) {
+		buf[i] = (guint8) i;
+	}
+	for (len = 0; len <= 64; len++) {
+		expect = crc32_old(0, buf, 64 + len);
+		got = qq_crc32(qq_crc32(0, buf, len), buf + len, 64);
+		if (got != expect) {
+			fprintf(stderr, "split at %d: 0x%08x, should be 0x%08x\n", len, got, expect);
+			failed++;
+		}
+	}
+
+	if (failed > 0) {
+		fprintf(stderr, "%d checks failed\n", failed);
+		return 1;
+	}
+	return 0;
+}
@@ -82,6 +82,60 @@ void qq_get_md5_str(guint8 *md5, gint md5_len, const guint8* const src, gint src
 	purple_cipher_context_destroy(context);
 }
 
+/* CRC32 (IEEE 802.3, reflected) sliced by 8 bytes.
+ * crc32_tables[0] is the classic byte table, crc32_tables[k] advances it by k more zero bytes */
+static guint32 crc32_tables[8][256];
+static GOnce crc32_once = G_ONCE_INIT;
+
+static gpointer crc32_make_tables(gpointer data)
+{
+	guint32 crc;
+	gint i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+		}
+		crc32_tables[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = crc32_tables[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = (crc >> 8) ^ crc32_tables[0][crc & 0xff];
+			crc32_tables[j][i] = crc;
+		}
+	}
+	return NULL;
+}
+
+/* same as crc32 of zlib, pass previous result as crc to continue */
+guint32 qq_crc32(guint32 crc, const guint8 *buf, gint len)
+{
+	guint32 lo, hi;
+
+	if (buf == NULL || len < 0)
+		return crc;
+
+	g_once(&crc32_once, crc32_make_tables, NULL);
+
+	crc ^= 0xffffffff;
+	while (len >= 8) {
+		lo = crc ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((guint32)buf[3] << 24));
+		hi = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((guint32)buf[7] << 24);
+		crc = crc32_tables[7][lo & 0xff] ^ crc32_tables[6][(lo >> 8) & 0xff]
+			^ crc32_tables[5][(lo >> 16) & 0xff] ^ crc32_tables[4][lo >> 24]
+			^ crc32_tables[3][hi & 0xff] ^ crc32_tables[2][(hi >> 8) & 0xff]
+			^ crc32_tables[1][(hi >> 16) & 0xff] ^ crc32_tables[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc32_tables[0][(crc ^ *buf++) & 0xff];
+
+	return crc ^ 0xffffffff;
+}
+
 gchar *get_name_by_index_str(gchar **array, const gchar *index_str, gint amount)
 {
 	gint index;